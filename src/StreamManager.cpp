@@ -8,6 +8,8 @@
 #include "StreamManager.h"
 
 #include "stream/FFmpegCatchupStream.h"
+#include "stream/TimeshiftExporter.h"
+#include "stream/TimeshiftSegmentJanitor.h"
 #include "stream/TimeshiftStream.h"
 #include "stream/url/URL.h"
 #include "utils/HttpProxy.h"
@@ -154,6 +156,26 @@ bool InputStreamFFmpegDirect::Open(const kodi::addon::InputstreamProperty& props
     {
       m_properties.m_programmeCatchupId = prop.second;
     }
+    else if (TIMESHIFT_COMPRESSION == prop.first)
+    {
+      if (StringUtils::EqualsNoCase(prop.second, "none"))
+        m_properties.m_timeshiftCompression = TimeshiftCompression::NONE;
+      else if (StringUtils::EqualsNoCase(prop.second, "zlib"))
+        m_properties.m_timeshiftCompression = TimeshiftCompression::ZLIB;
+      else if (StringUtils::EqualsNoCase(prop.second, "bzip2"))
+        m_properties.m_timeshiftCompression = TimeshiftCompression::BZIP2;
+    }
+    else if (TIMESHIFT_MODE == prop.first)
+    {
+      if (StringUtils::EqualsNoCase(prop.second, "disk"))
+        m_properties.m_timeshiftMode = TimeshiftMode::DISK;
+      else if (StringUtils::EqualsNoCase(prop.second, "memory"))
+        m_properties.m_timeshiftMode = TimeshiftMode::MEMORY;
+    }
+    else if (TIMESHIFT_EXPORT_FILE == prop.first)
+    {
+      m_properties.m_timeshiftExportFile = prop.second;
+    }
   }
 
   m_streamUrl = props.GetURL();
@@ -387,6 +409,14 @@ class ATTR_DLL_LOCAL CMyAddon
 {
 public:
   CMyAddon() = default;
+  ~CMyAddon()
+  {
+    // Finish deleting timeshift files while the addon is still loaded, exports
+    // go first as they can be holding on to timeshift buffers
+    TimeshiftExporter::GetInstance().Stop();
+    TimeshiftSegmentJanitor::GetInstance().Stop();
+  }
+
   ADDON_STATUS CreateInstance(const kodi::addon::IInstanceInfo& instance,
                               KODI_ADDON_INSTANCE_HDL& hdl) override
   {
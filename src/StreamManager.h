@@ -35,6 +35,9 @@ static const std::string CATCHUP_GRANULARITY = "inputstream.ffmpegdirect.catchup
 static const std::string TIMEZONE_SHIFT = "inputstream.ffmpegdirect.timezone_shift";
 static const std::string DEFAULT_PROGRAMME_DURATION = "inputstream.ffmpegdirect.default_programme_duration";
 static const std::string PROGRAMME_CATCHUP_ID = "inputstream.ffmpegdirect.programme_catchup_id";
+static const std::string TIMESHIFT_COMPRESSION = "inputstream.ffmpegdirect.timeshift_compression";
+static const std::string TIMESHIFT_MODE = "inputstream.ffmpegdirect.timeshift_mode";
+static const std::string TIMESHIFT_EXPORT_FILE = "inputstream.ffmpegdirect.timeshift_export_file";
 
 class ATTR_DLL_LOCAL InputStreamFFmpegDirect
   : public kodi::addon::CInstanceInputStream, ffmpegdirect::IManageDemuxPacket
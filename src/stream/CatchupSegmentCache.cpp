@@ -0,0 +1,198 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "CatchupSegmentCache.h"
+
+#include "../utils/Log.h"
+
+#include <algorithm>
+
+using namespace ffmpegdirect;
+
+void CatchupSegmentCache::StartRange(bool continueRange)
+{
+  std::shared_ptr<CatchupCacheRange> range;
+  if (continueRange)
+    range = m_readRange ? m_readRange : m_recordRange;
+
+  StopReading();
+  CompleteWriteSegment();
+
+  // A new range is only created once there's a packet for it
+  m_recordRange = range;
+}
+
+void CatchupSegmentCache::AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe)
+{
+  const double timestamp = packet->pts != STREAM_NOPTS_VALUE ? packet->pts : packet->dts;
+  if (timestamp == STREAM_NOPTS_VALUE)
+    return;
+
+  const int64_t timeIndex = PtsToTimeIndexMs(timestamp);
+
+  if (videoKeyframe)
+    m_hasVideoKeyframes = true;
+
+  if (!m_recordRange)
+  {
+    m_recordRange = std::make_shared<CatchupCacheRange>();
+    m_ranges.emplace_back(m_recordRange);
+  }
+
+  // Segments are split the same way as in a timeshift buffer so seeks can start from a keyframe
+  bool startNewSegment = !m_writeSegment;
+  if (m_writeSegment)
+  {
+    const int64_t segmentLengthMs = timeIndex - m_recordRange->m_segments.back().m_timeIndexStart;
+    if (segmentLengthMs >= CACHE_SEGMENT_LENGTH_MS)
+    {
+      if (m_hasVideoKeyframes && segmentLengthMs < CACHE_SEGMENT_MAX_LENGTH_MS)
+        startNewSegment = videoKeyframe;
+      else
+        startNewSegment = timeIndex != m_lastPacketTimeIndex;
+    }
+
+    if (m_writeSegment->IsFull())
+      startNewSegment = true;
+  }
+
+  if (startNewSegment)
+  {
+    CompleteWriteSegment();
+
+    std::shared_ptr<TimeshiftSegment> segment = std::make_shared<TimeshiftSegment>("catchup", m_segmentCount++);
+
+    // A continued range is read straight through from the segments recorded before
+    if (!m_recordRange->m_segments.empty())
+      m_recordRange->m_segments.back().m_segment->SetNextSegment(segment);
+
+    m_writeSegment = segment;
+    m_recordRange->m_segments.push_back({timeIndex, segment});
+  }
+
+  m_writeSegment->AddPacket(packet, videoKeyframe);
+
+  m_recordRange->m_timeIndexEnd = std::max(m_recordRange->m_timeIndexEnd, timeIndex);
+  m_recordRange->m_lastUsed = ++m_useCount;
+  m_lastPacketTimeIndex = timeIndex;
+}
+
+bool CatchupSegmentCache::Seek(double timeMs, double& startPts)
+{
+  const int64_t seekMs = static_cast<int64_t>(timeMs);
+
+  // If more than one range has the time the one going on the longest is used
+  std::shared_ptr<CatchupCacheRange> seekRange;
+  for (const auto& range : m_ranges)
+  {
+    if (range->m_segments.empty() || seekMs < range->m_segments.front().m_timeIndexStart || seekMs >= range->m_timeIndexEnd)
+      continue;
+
+    if (!seekRange || range->m_timeIndexEnd > seekRange->m_timeIndexEnd)
+      seekRange = range;
+  }
+
+  if (!seekRange)
+    return false;
+
+  // Recording stops here, the range being read is never removed to stay in budget
+  m_readRange = seekRange;
+  m_readRange->m_lastUsed = ++m_useCount;
+  CompleteWriteSegment();
+  m_recordRange.reset();
+
+  // Upper bound gets the segment after the one we want
+  const std::vector<CatchupCacheSegment>& segments = m_readRange->m_segments;
+  auto seekSegment = std::upper_bound(segments.cbegin(), segments.cend(), seekMs,
+                                      [](int64_t timeIndex, const CatchupCacheSegment& entry) { return timeIndex < entry.m_timeIndexStart; });
+  if (seekSegment != segments.cbegin())
+    --seekSegment;
+
+  m_readPosition = TimeshiftSegmentReadPosition();
+  if (seekSegment == segments.cend() || !seekSegment->m_segment->Seek(timeMs, m_readPosition))
+  {
+    StopReading();
+    return false;
+  }
+  m_readSegment = seekSegment->m_segment;
+
+  startPts = m_readSegment->GetPacketPts(m_readPosition);
+  if (startPts == STREAM_NOPTS_VALUE)
+    startPts = STREAM_MSEC_TO_TIME(timeMs);
+
+  Log(LOGLEVEL_DEBUG, "%s - Seek ms: %lld, cached range ms: %lld to %lld", __FUNCTION__, static_cast<long long>(seekMs),
+      static_cast<long long>(segments.front().m_timeIndexStart), static_cast<long long>(m_readRange->m_timeIndexEnd));
+
+  return true;
+}
+
+DEMUX_PACKET* CatchupSegmentCache::ReadPacket(IManageDemuxPacket* demuxPacketManager)
+{
+  while (m_readSegment && !m_readSegment->HasPacketAvailable(m_readPosition))
+  {
+    m_readSegment = m_readSegment->GetNextSegment();
+    m_readPosition = TimeshiftSegmentReadPosition();
+  }
+
+  if (!m_readSegment)
+    return nullptr;
+
+  return m_readSegment->ReadPacket(demuxPacketManager, m_readPosition);
+}
+
+void CatchupSegmentCache::StopReading()
+{
+  m_readRange.reset();
+  m_readSegment.reset();
+  m_readPosition = TimeshiftSegmentReadPosition();
+}
+
+void CatchupSegmentCache::CompleteWriteSegment()
+{
+  if (!m_writeSegment)
+    return;
+
+  m_writeSegment->MarkAsComplete();
+  m_writeSegment.reset();
+
+  RemoveSegmentsOverMemoryBudget();
+}
+
+void CatchupSegmentCache::RemoveSegmentsOverMemoryBudget()
+{
+  // The size of a segment depends on the bitrate so the actual usage is measured
+  size_t memoryUsed = 0;
+  for (const auto& range : m_ranges)
+  {
+    for (const auto& segment : range->m_segments)
+      memoryUsed += segment.m_segment->GetMemorySize();
+  }
+
+  while (memoryUsed > m_memoryBudget)
+  {
+    auto leastRecentlyUsed = m_ranges.end();
+    for (auto it = m_ranges.begin(); it != m_ranges.end(); ++it)
+    {
+      if (*it != m_readRange && !(*it)->m_segments.empty() &&
+          (leastRecentlyUsed == m_ranges.end() || (*it)->m_lastUsed < (*leastRecentlyUsed)->m_lastUsed))
+        leastRecentlyUsed = it;
+    }
+
+    if (leastRecentlyUsed == m_ranges.end())
+      break;
+
+    std::vector<CatchupCacheSegment>& segments = (*leastRecentlyUsed)->m_segments;
+    memoryUsed -= segments.front().m_segment->GetMemorySize();
+    segments.erase(segments.begin());
+
+    // The range being recorded is kept even when empty as packets are still being added to it
+    if (segments.empty() && *leastRecentlyUsed != m_recordRange)
+      m_ranges.erase(leastRecentlyUsed);
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - Cached ranges: %d, memory used: %lld bytes", __FUNCTION__, static_cast<int>(m_ranges.size()), static_cast<long long>(memoryUsed));
+}
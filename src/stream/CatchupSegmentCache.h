@@ -0,0 +1,93 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "IManageDemuxPacket.h"
+#include "TimeshiftSegment.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <kodi/addon-instance/Inputstream.h>
+
+namespace ffmpegdirect
+{
+
+struct CatchupCacheSegment
+{
+  int64_t m_timeIndexStart; // milliseconds
+  std::shared_ptr<TimeshiftSegment> m_segment;
+};
+
+/*
+ * A continuous run of packets from the provider, e.g. from one seek to the next
+ */
+struct CatchupCacheRange
+{
+  int64_t m_timeIndexEnd = 0; // milliseconds
+  uint64_t m_lastUsed = 0;
+  std::vector<CatchupCacheSegment> m_segments; // oldest first
+};
+
+/*
+ * Keeps the packets of a catchup stream which have already been played in memory, in
+ * the same segments as a timeshift buffer and indexed by time in the catchup buffer.
+ * A seek back into a range already played is read from the cache rather than reopening
+ * the provider's stream. When over the memory budget the oldest segments of the least
+ * recently used range are removed.
+ *
+ * Only used from the demux thread so there's no locking.
+ */
+class CatchupSegmentCache
+{
+public:
+  CatchupSegmentCache(size_t memoryBudget) : m_memoryBudget(memoryBudget) {}
+
+  /*
+   * The provider's stream was opened, the packets added from now on are a new range unless
+   * they continue the range being recorded or the range which was just read to the end.
+   */
+  void StartRange(bool continueRange);
+  void AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe);
+
+  /*
+   * Returns false if the time isn't cached, otherwise reading starts from the nearest keyframe,
+   * whose pts is returned as the start pts, and the range being recorded is ended.
+   */
+  bool Seek(double timeMs, double& startPts);
+  bool IsReading() const { return m_readRange != nullptr; }
+  // Returns nullptr once the end of the range has been read
+  DEMUX_PACKET* ReadPacket(IManageDemuxPacket* demuxPacketManager);
+  int64_t GetReadEndTimeMs() const { return m_readRange ? m_readRange->m_timeIndexEnd : -1; }
+  void StopReading();
+
+private:
+  static const int64_t CACHE_SEGMENT_LENGTH_MS = 12 * 1000;
+  static const int64_t CACHE_SEGMENT_MAX_LENGTH_MS = CACHE_SEGMENT_LENGTH_MS * 2;
+
+  void CompleteWriteSegment();
+  void RemoveSegmentsOverMemoryBudget();
+
+  std::vector<std::shared_ptr<CatchupCacheRange>> m_ranges;
+  uint64_t m_useCount = 0;
+
+  std::shared_ptr<CatchupCacheRange> m_recordRange;
+  std::shared_ptr<TimeshiftSegment> m_writeSegment;
+  int64_t m_lastPacketTimeIndex = 0;
+  bool m_hasVideoKeyframes = false;
+  int m_segmentCount = 0;
+
+  std::shared_ptr<CatchupCacheRange> m_readRange;
+  std::shared_ptr<TimeshiftSegment> m_readSegment;
+  TimeshiftSegmentReadPosition m_readPosition;
+
+  size_t m_memoryBudget;
+};
+
+} //namespace ffmpegdirect
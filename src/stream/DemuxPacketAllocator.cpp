@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "DemuxPacketAllocator.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+using namespace ffmpegdirect;
+
+DEMUX_PACKET* DemuxPacketAllocator::AllocateDemuxPacketFromInputStreamAPI(int dataSize)
+{
+  DEMUX_PACKET* packet = new DEMUX_PACKET();
+
+  // Use the same defaults as a packet allocated through kodi
+  packet->iStreamId = -1;
+  packet->demuxerId = -1;
+  packet->iGroupId = -1;
+  packet->pts = STREAM_NOPTS_VALUE;
+  packet->dts = STREAM_NOPTS_VALUE;
+
+  if (dataSize > 0)
+  {
+    packet->pData = static_cast<uint8_t*>(av_mallocz(dataSize + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!packet->pData)
+    {
+      delete packet;
+      return nullptr;
+    }
+  }
+
+  return packet;
+}
+
+DEMUX_PACKET* DemuxPacketAllocator::AllocateEncryptedDemuxPacketFromInputStreamAPI(int dataSize, unsigned int encryptedSubsampleCount)
+{
+  return nullptr;
+}
+
+void DemuxPacketAllocator::FreeDemuxPacketFromInputStreamAPI(DEMUX_PACKET* packet)
+{
+  if (!packet)
+    return;
+
+  // Side data is allocated by ffmpeg but the packet holding it has already been freed
+  AVPacketSideData* sideData = static_cast<AVPacketSideData*>(packet->pSideData);
+  for (int i = 0; i < packet->iSideDataElems; i++)
+    av_freep(&sideData[i].data);
+  av_free(sideData);
+
+  av_free(packet->pData);
+  delete packet;
+}
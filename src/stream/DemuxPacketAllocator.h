@@ -0,0 +1,31 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "IManageDemuxPacket.h"
+
+#include <kodi/addon-instance/Inputstream.h>
+
+namespace ffmpegdirect
+{
+
+/*
+ * Allocates demux packets in the addon rather than through a kodi instance, for packets
+ * which are never handed to kodi and could outlive the instance, e.g. the timeshift ingest
+ * once the stream which opened it has been closed. Encrypted packets need kodi, so by
+ * default they can't be allocated.
+ */
+class DemuxPacketAllocator : public IManageDemuxPacket
+{
+public:
+  DEMUX_PACKET* AllocateDemuxPacketFromInputStreamAPI(int dataSize) override;
+  DEMUX_PACKET* AllocateEncryptedDemuxPacketFromInputStreamAPI(int dataSize, unsigned int encryptedSubsampleCount) override;
+  void FreeDemuxPacketFromInputStreamAPI(DEMUX_PACKET* packet) override;
+};
+
+} //namespace ffmpegdirect
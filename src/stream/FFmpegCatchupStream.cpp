@@ -56,6 +56,10 @@ FFmpegCatchupStream::FFmpegCatchupStream(IManageDemuxPacket* demuxPacketManager,
     m_defaultProgrammeDuration(props.m_defaultProgrammeDurationSecs), m_programmeCatchupId(props.m_programmeCatchupId)
 {
   m_catchupGranularityLowWaterMark = m_catchupGranularity - (m_catchupGranularity / 4);
+
+  int cacheSizeMB = 0;
+  if (kodi::addon::CheckSettingInt("catchupCacheSize", cacheSizeMB) && cacheSizeMB > 0)
+    m_segmentCache = std::make_unique<CatchupSegmentCache>(static_cast<size_t>(cacheSizeMB) * 1024 * 1024);
 }
 
 FFmpegCatchupStream::~FFmpegCatchupStream()
@@ -84,6 +88,25 @@ bool FFmpegCatchupStream::DemuxSeekTime(double timeMs, bool backwards, double& s
   if (/*!m_pInput ||*/ timeMs < 0)
     return false;
 
+  // A seek back to something already played doesn't need the provider's stream to be reopened
+  if (m_segmentCache && !m_isOpeningStream && !m_seekCorrectsEOF)
+  {
+    m_cacheResumeTimeMs = -1;
+
+    if (m_segmentCache->Seek(timeMs, startpts))
+    {
+      // Nothing is read from the provider until the end of the cache, where it's reopened
+      CloseInput();
+
+      std::lock_guard<std::recursive_mutex> lock(m_mutex);
+      m_currentDemuxTime = timeMs;
+      m_currentPts = STREAM_NOPTS_VALUE;
+
+      Log(LOGLEVEL_INFO, "%s - Seek to cached time: %lld", __FUNCTION__, static_cast<long long>(timeMs));
+      return true;
+    }
+  }
+
   int64_t seekResult = SeekCatchupStream(timeMs, backwards);
   if (seekResult >= 0)
   {
@@ -92,6 +115,9 @@ bool FFmpegCatchupStream::DemuxSeekTime(double timeMs, bool backwards, double& s
       m_seekOffset = seekResult;
     }
 
+    if (m_segmentCache)
+      m_segmentCache->StartRange(m_seekCorrectsEOF);
+
     Log(LOGLEVEL_DEBUG, "%s - Seek successful. m_seekOffset = %f, m_currentPts = %f, time = %f, backwards = %d, startpts = %f",
       __FUNCTION__, m_seekOffset, m_currentPts, timeMs, backwards, startpts);
 
@@ -111,6 +137,37 @@ bool FFmpegCatchupStream::DemuxSeekTime(double timeMs, bool backwards, double& s
 
 DEMUX_PACKET* FFmpegCatchupStream::DemuxRead()
 {
+  if (m_segmentCache && m_segmentCache->IsReading())
+  {
+    DEMUX_PACKET* pPacket = m_segmentCache->ReadPacket(m_demuxPacketManager);
+    if (pPacket)
+    {
+      std::lock_guard<std::recursive_mutex> lock(m_mutex);
+      pPacket->demuxerId = m_demuxerId;
+
+      const double timestamp = pPacket->pts != STREAM_NOPTS_VALUE ? pPacket->pts : pPacket->dts;
+      if (timestamp != STREAM_NOPTS_VALUE)
+      {
+        m_currentDemuxTime = timestamp / 1000;
+        if (timestamp > m_currentPts || m_currentPts == STREAM_NOPTS_VALUE)
+          m_currentPts = timestamp;
+      }
+
+      return pPacket;
+    }
+
+    // The end of what was cached, carry on from the provider's stream as if it were a continuation
+    const int64_t cacheEndTimeMs = m_segmentCache->GetReadEndTimeMs();
+    Log(LOGLEVEL_INFO, "%s - End of cached range, reopening stream at: %lld", __FUNCTION__, static_cast<long long>(cacheEndTimeMs));
+
+    m_seekCorrectsEOF = true;
+    DemuxSeekTime(static_cast<double>(cacheEndTimeMs));
+    m_seekCorrectsEOF = false;
+
+    m_cacheResumeTimeMs = cacheEndTimeMs;
+    m_segmentCache->StopReading();
+  }
+
   DEMUX_PACKET* pPacket = FFmpegStream::DemuxRead();
   if (pPacket)
   {
@@ -118,6 +175,19 @@ DEMUX_PACKET* FFmpegCatchupStream::DemuxRead()
     pPacket->pts += m_seekOffset;
     pPacket->dts += m_seekOffset;
 
+    if (m_segmentCache && pPacket->iStreamId >= 0 && pPacket->iSize > 0)
+    {
+      // The reopened stream can start before the end of the cache, skip what was already played
+      const double timestamp = pPacket->pts != STREAM_NOPTS_VALUE ? pPacket->pts : pPacket->dts;
+      if (m_cacheResumeTimeMs >= 0 && timestamp != STREAM_NOPTS_VALUE && PtsToTimeIndexMs(timestamp) <= m_cacheResumeTimeMs)
+      {
+        m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(pPacket);
+        return m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+      }
+
+      m_segmentCache->AddPacket(pPacket, m_lastPacketVideoKeyframe);
+    }
+
     if (m_lastPacketResult == AVERROR_EOF && m_catchupTerminates && !m_isOpeningStream && !m_lastSeekWasLive)
     {
       if (!m_lastPacketWasAvoidedEOF)
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include "CatchupSegmentCache.h"
 #include "FFmpegStream.h"
 #include "../utils/HttpProxy.h"
 #include "../utils/TimeUtils.h"
@@ -84,6 +85,9 @@ protected:
   bool m_lastSeekWasLive = false;
   bool m_lastPacketWasAvoidedEOF = false;
   bool m_seekCorrectsEOF = false;
+
+  std::unique_ptr<CatchupSegmentCache> m_segmentCache;
+  int64_t m_cacheResumeTimeMs = -1; // packets up to this time were read from the cache
 };
 
 } //namespace ffmpegdirect
@@ -149,6 +149,7 @@ FFmpegStream::FFmpegStream(IManageDemuxPacket* demuxPacketManager, const Propert
   m_program = UINT_MAX;
   m_pkt.result = -1;
   memset(&m_pkt.pkt, 0, sizeof(AVPacket));
+  memset(&m_sinkPkt, 0, sizeof(AVPacket));
   m_streaminfo = true; /* set to true if we want to look for streams before playback */
   m_checkTransportStream = false;
   m_dtsAtDisplayTime = STREAM_NOPTS_VALUE;
@@ -174,9 +175,7 @@ bool FFmpegStream::Open(const std::string& streamUrl, const std::string& mimeTyp
   m_programProperty = programProperty;
 
   if (m_openMode == OpenMode::CURL)
-    m_curlInput->Open(m_streamUrl, m_mimeType, ADDON_READ_TRUNCATED |
-                                               ADDON_READ_BITRATE |
-                                               ADDON_READ_CHUNKED);
+    OpenCurlInput();
 
   m_opened = Open(false);
   if (m_opened)
@@ -189,6 +188,13 @@ bool FFmpegStream::Open(const std::string& streamUrl, const std::string& mimeTyp
   return m_opened;
 }
 
+void FFmpegStream::OpenCurlInput()
+{
+  m_curlInput->Open(m_streamUrl, m_mimeType, ADDON_READ_TRUNCATED |
+                                             ADDON_READ_BITRATE |
+                                             ADDON_READ_CHUNKED);
+}
+
 void FFmpegStream::Close()
 {
   m_paused = false;
@@ -258,13 +264,33 @@ void FFmpegStream::DemuxReset()
   m_demuxResetOpenSuccess = false;
   Dispose();
   // Here we update the filename and call reset in case the
-  // implementation needs to restart the stream
+  // implementation needs to restart the stream, a closed input is opened again
   m_curlInput->SetFilename(m_streamUrl);
-  m_curlInput->Reset();
+  if (m_inputClosed && m_openMode == OpenMode::CURL)
+    OpenCurlInput();
+  else
+    m_curlInput->Reset();
+  m_inputClosed = false;
   m_opened = false;
   m_demuxResetOpenSuccess = Open(false);
 }
 
+void FFmpegStream::CloseInput()
+{
+  std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+  m_pkt.result = -1;
+  av_packet_unref(&m_pkt.pkt);
+
+  // The demuxer is kept as its streams and duration are still asked for
+  if (m_openMode == OpenMode::CURL)
+    m_curlInput->Close();
+  else if (m_pFormatContext && !(m_pFormatContext->flags & AVFMT_FLAG_CUSTOM_IO))
+    avio_closep(&m_pFormatContext->pb);
+
+  m_inputClosed = true;
+}
+
 void FFmpegStream::DemuxAbort()
 {
   m_timeout.SetExpired();
@@ -290,13 +316,94 @@ void FFmpegStream::DemuxFlush()
 }
 
 DEMUX_PACKET* FFmpegStream::DemuxRead()
+{
+  return DemuxReadPacket(nullptr);
+}
+
+void FFmpegStream::DemuxReadToSink(IDemuxPacketSink& sink)
+{
+  DEMUX_PACKET sinkPacket;
+  DEMUX_PACKET* pPacket = DemuxReadPacket(&sinkPacket);
+  if (pPacket)
+    sink.WriteDemuxPacket(pPacket, pPacket->iStreamId >= 0 && m_lastPacketVideoKeyframe);
+
+  // The sink has copied what it needs so the borrowed data can be released
+  av_packet_unref(&m_sinkPkt);
+}
+
+std::map<int, AVCodecParameters*> FFmpegStream::CopyCodecParameters()
+{
+  std::lock_guard<std::recursive_mutex> lock(m_mutex);
+  std::map<int, AVCodecParameters*> codecParameters;
+
+  if (!m_pFormatContext)
+    return codecParameters;
+
+  // The stream IDs of packets are the indexes of the demuxer's streams
+  for (const auto& stream : m_streams)
+  {
+    if (stream.first < 0 || stream.first >= static_cast<int>(m_pFormatContext->nb_streams))
+      continue;
+
+    AVCodecParameters* parameters = avcodec_parameters_alloc();
+    if (!parameters || avcodec_parameters_copy(parameters, m_pFormatContext->streams[stream.first]->codecpar) < 0)
+    {
+      avcodec_parameters_free(&parameters);
+      continue;
+    }
+
+    // For some formats, e.g. transport streams, the extradata is only found by the parser
+    const FFmpegExtraData& extraData = stream.second->extraData;
+    if (parameters->extradata_size == 0 && extraData)
+    {
+      parameters->extradata = static_cast<uint8_t*>(av_mallocz(extraData.GetSize() + AV_INPUT_BUFFER_PADDING_SIZE));
+      if (parameters->extradata)
+      {
+        memcpy(parameters->extradata, extraData.GetData(), extraData.GetSize());
+        parameters->extradata_size = static_cast<int>(extraData.GetSize());
+      }
+    }
+
+    codecParameters[stream.first] = parameters;
+  }
+
+  return codecParameters;
+}
+
+void FFmpegStream::SetDemuxPacketManager(IManageDemuxPacket* demuxPacketManager)
+{
+  std::lock_guard<std::recursive_mutex> lock(m_mutex);
+  m_demuxPacketManager = demuxPacketManager;
+}
+
+DEMUX_PACKET* FFmpegStream::AllocateDemuxPacket(IManageDemuxPacket* demuxPacketManager, int dataSize, DEMUX_PACKET* sinkPacket)
+{
+  if (!sinkPacket)
+    return demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(dataSize);
+
+  // Use the same defaults as a packet allocated through kodi
+  *sinkPacket = {};
+  sinkPacket->iStreamId = -1;
+  sinkPacket->demuxerId = -1;
+  sinkPacket->iGroupId = -1;
+  sinkPacket->pts = STREAM_NOPTS_VALUE;
+  sinkPacket->dts = STREAM_NOPTS_VALUE;
+
+  return sinkPacket;
+}
+
+DEMUX_PACKET* FFmpegStream::DemuxReadPacket(DEMUX_PACKET* sinkPacket)
 {
   DEMUX_PACKET* pPacket = NULL;
+  m_lastPacketVideoKeyframe = false;
   // on some cases where the received packet is invalid we will need to return an empty packet (0 length) otherwise the main loop (in CVideoPlayer)
   // would consider this the end of stream and stop.
   bool bReturnEmpty = false;
+  IManageDemuxPacket* demuxPacketManager = nullptr;
   { std::lock_guard<std::recursive_mutex> lock(m_mutex); // open lock scope
-  if (m_pFormatContext)
+  // The manager can be replaced by another thread, a packet is always freed through the one that allocated it
+  demuxPacketManager = m_demuxPacketManager;
+  if (m_pFormatContext && !m_inputClosed)
   {
     // assume we are not eof
     if (m_pFormatContext->pb)
@@ -362,7 +469,7 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
         // update streams
         CreateStreams(m_program);
 
-        pPacket = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+        pPacket = AllocateDemuxPacket(demuxPacketManager, 0, sinkPacket);
         pPacket->iStreamId = DEMUX_SPECIALID_STREAMCHANGE;
         pPacket->demuxerId = m_demuxerId;
 
@@ -380,7 +487,7 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
           {
             if (m_pkt.pkt.stream_index == (int)m_pFormatContext->programs[m_program]->stream_index[i])
             {
-              pPacket = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(m_pkt.pkt.size);
+              pPacket = AllocateDemuxPacket(demuxPacketManager, m_pkt.pkt.size, sinkPacket);
               break;
             }
           }
@@ -389,7 +496,7 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
             bReturnEmpty = true;
         }
         else
-          pPacket = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(m_pkt.pkt.size);
+          pPacket = AllocateDemuxPacket(demuxPacketManager, m_pkt.pkt.size, sinkPacket);
       }
       else
         bReturnEmpty = true;
@@ -403,21 +510,38 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
           m_pkt.pkt.pts = AV_NOPTS_VALUE;
         }
 
+        m_lastPacketVideoKeyframe = (m_pkt.pkt.flags & AV_PKT_FLAG_KEY) && stream->codecpar &&
+                                    stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+
         // copy contents into our own packet
         pPacket->iSize = m_pkt.pkt.size;
 
-        // maybe we can avoid a memcpy here by detecting where pkt.destruct is pointing too?
-        if (m_pkt.pkt.data)
+        // a sink borrows the data for the duration of the write so there's nothing to copy
+        if (sinkPacket)
+          pPacket->pData = m_pkt.pkt.data;
+        else if (m_pkt.pkt.data)
           memcpy(pPacket->pData, m_pkt.pkt.data, pPacket->iSize);
 
-        pPacket->pts = ConvertTimestamp(m_pkt.pkt.pts, stream->time_base.den, stream->time_base.num);
-        pPacket->dts = ConvertTimestamp(m_pkt.pkt.dts, stream->time_base.den, stream->time_base.num);
-        pPacket->duration =  STREAM_SEC_TO_TIME((double)m_pkt.pkt.duration * stream->time_base.num / stream->time_base.den);
+        // the time base and start time are worked out once for all of the packet's timestamps
+        const double timeBase = av_q2d(stream->time_base);
+        const double startTime = GetTimestampStartTime();
+        pPacket->pts = ConvertTimestamp(m_pkt.pkt.pts, timeBase, startTime);
+        pPacket->dts = ConvertTimestamp(m_pkt.pkt.dts, timeBase, startTime);
+        pPacket->duration =  STREAM_SEC_TO_TIME((double)m_pkt.pkt.duration * timeBase);
 
-        StoreSideData(pPacket, &m_pkt.pkt);
+        if (sinkPacket)
+        {
+          pPacket->pSideData = m_pkt.pkt.side_data;
+          pPacket->iSideDataElems = m_pkt.pkt.side_data_elems;
+        }
+        else
+        {
+          StoreSideData(pPacket, &m_pkt.pkt);
+        }
 
         // TODO check this is ok to do.
-        int dispTime = GetTime();
+        // not virtual, the display time always follows this demuxer's own pts
+        int dispTime = FFmpegStream::GetTime();
         if (m_displayTime != dispTime)
         {
           m_displayTime = dispTime;
@@ -449,17 +573,21 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
         pPacket->iStreamId = m_pkt.pkt.stream_index;
       }
       m_pkt.result = -1;
-      av_packet_unref(&m_pkt.pkt);
+      // keep the data referenced by a sink packet alive until it has been written
+      if (pPacket && pPacket == sinkPacket)
+        av_packet_move_ref(&m_sinkPkt, &m_pkt.pkt);
+      else
+        av_packet_unref(&m_pkt.pkt);
     }
   }
-  } // end of lock scope
   if (bReturnEmpty && !pPacket)
-    pPacket = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+    pPacket = AllocateDemuxPacket(demuxPacketManager, 0, sinkPacket);
 
   if (!pPacket)
     return nullptr;
 
   // check streams, can we make this a bit more simple?
+  // streams are only added under the lock so other threads can read them while holding it
   if (pPacket->iStreamId >= 0)
   {
     DemuxStream* stream = GetDemuxStream(pPacket->iStreamId);
@@ -473,7 +601,8 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
     // we already check for a valid m_streams[pPacket->iStreamId] above
     else if (stream->type == INPUTSTREAM_TYPE_AUDIO)
     {
-      DemuxStreamAudio* audiostream = dynamic_cast<DemuxStreamAudio*>(stream);
+      // only a DemuxStreamAudio has the audio type
+      DemuxStreamAudio* audiostream = static_cast<DemuxStreamAudio*>(stream);
       int codecparChannels =
           m_pFormatContext->streams[pPacket->iStreamId]->codecpar->ch_layout.nb_channels;
       if (audiostream && (audiostream->iChannels != codecparChannels ||
@@ -498,14 +627,16 @@ DEMUX_PACKET* FFmpegStream::DemuxRead()
     }
     if (!stream)
     {
-      m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(pPacket);
-      pPacket = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+      if (pPacket != sinkPacket)
+        demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(pPacket);
+      pPacket = AllocateDemuxPacket(demuxPacketManager, 0, sinkPacket);
       return pPacket;
     }
 
     pPacket->iStreamId = stream->uniqueId;
     pPacket->demuxerId = m_demuxerId;
   }
+  } // end of lock scope
   return pPacket;
 }
 
@@ -660,6 +791,7 @@ void FFmpegStream::DisposeStreams()
   for(it = m_streams.begin(); it != m_streams.end(); ++it)
     delete it->second;
   m_streams.clear();
+  m_streamsByIndex.clear();
   m_parsers.clear();
 }
 
@@ -1160,24 +1292,31 @@ void FFmpegStream::CurrentPTSUpdated()
 
 double FFmpegStream::ConvertTimestamp(int64_t pts, int den, int num)
 {
-  if (pts == (int64_t)AV_NOPTS_VALUE)
-    return STREAM_NOPTS_VALUE;
+  return ConvertTimestamp(pts, static_cast<double>(num) / den, GetTimestampStartTime());
+}
 
-  // do calculations in floats as they can easily overflow otherwise
-  // we don't care for having a completely exact timestamp anyway
-  double timestamp = (double)pts * num / den;
-  double starttime = 0.0;
+double FFmpegStream::GetTimestampStartTime() const
+{
+  if (m_checkTransportStream)
+    return m_startTime;
 
   //const std::shared_ptr<CDVDInputStream::IMenus> menuInterface =
   //    std::dynamic_pointer_cast<CDVDInputStream::IMenus>(m_pInput);
   //if ((!menuInterface || menuInterface->GetSupportedMenuType() != MenuType::NATIVE) &&
   if (m_pFormatContext->start_time != static_cast<int64_t>(AV_NOPTS_VALUE))
-  {
-    starttime = static_cast<double>(m_pFormatContext->start_time) / AV_TIME_BASE;
-  }
+    return static_cast<double>(m_pFormatContext->start_time) / AV_TIME_BASE;
 
-  if (m_checkTransportStream)
-    starttime = m_startTime;
+  return 0.0;
+}
+
+double FFmpegStream::ConvertTimestamp(int64_t pts, double timeBase, double starttime)
+{
+  if (pts == (int64_t)AV_NOPTS_VALUE)
+    return STREAM_NOPTS_VALUE;
+
+  // do calculations in floats as they can easily overflow otherwise
+  // we don't care for having a completely exact timestamp anyway
+  double timestamp = (double)pts * timeBase;
 
   if (!m_bSup)
   {
@@ -1314,9 +1453,8 @@ unsigned int FFmpegStream::HLSSelectProgram()
  */
 DemuxStream* FFmpegStream::GetDemuxStream(int iStreamId) const
 {
-  auto it = m_streams.find(iStreamId);
-  if (it != m_streams.end())
-    return it->second;
+  if (iStreamId >= 0 && iStreamId < static_cast<int>(m_streamsByIndex.size()))
+    return m_streamsByIndex[iStreamId];
 
   return nullptr;
 }
@@ -1433,6 +1571,10 @@ std::string FFmpegStream::ConvertCodecToInternalStereoMode(const std::string &mo
 
 void FFmpegStream::StoreSideData(DEMUX_PACKET *pkt, AVPacket *src)
 {
+  // most packets have no side data, there's nothing to allocate for them
+  if (src->side_data_elems == 0)
+    return;
+
   AVPacket* avPkt = av_packet_alloc();
   if (!avPkt)
   {
@@ -2304,6 +2446,10 @@ void FFmpegStream::AddStream(int streamIdx, DemuxStream* stream)
     res.first->second = stream;
   }
 
+  if (streamIdx >= static_cast<int>(m_streamsByIndex.size()))
+    m_streamsByIndex.resize(streamIdx + 1, nullptr);
+  m_streamsByIndex[streamIdx] = stream;
+
   stream->codecName = GetStreamCodecName(stream->uniqueId);
   Log(LOGLEVEL_DEBUG, "CDVDDemuxFFmpeg::AddStream ID: %d", streamIdx);
 }
@@ -12,6 +12,7 @@
 #include "BaseStream.h"
 #include "DemuxStream.h"
 #include "CurlInput.h"
+#include "IDemuxPacketSink.h"
 
 #include <iostream>
 #include <map>
@@ -19,6 +20,7 @@
 #include <mutex>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include <kodi/addon-instance/Inputstream.h>
 #include <kodi/tools/EndTime.h>
@@ -76,6 +78,13 @@ public:
   virtual DEMUX_PACKET* DemuxRead() override;
   virtual bool DemuxSeekTime(double time, bool backwards, double& startpts) override;
   virtual void DemuxSetSpeed(int speed) override;
+  // Same as DemuxRead() but hands the packet to the sink without allocating it through kodi
+  void DemuxReadToSink(IDemuxPacketSink& sink);
+  // Copies of the codec parameters of the streams by stream ID, e.g. for remuxing. The
+  // caller owns the copies and frees them with avcodec_parameters_free()
+  std::map<int, AVCodecParameters*> CopyCodecParameters();
+  // Replaces the packet manager, a read in progress carries on with the one it started with
+  void SetDemuxPacketManager(IManageDemuxPacket* demuxPacketManager);
   virtual void SetVideoResolution(unsigned int width, unsigned int height) override;
 
   virtual int GetTotalTime() override;// { return 20; }
@@ -107,6 +116,8 @@ protected:
   virtual void CurrentPTSUpdated();
   bool IsPaused() { return m_speed == STREAM_PLAYSPEED_PAUSE; }
   virtual bool CheckReturnEmptyOnPacketResult(int result);
+  // Closes the connection but keeps the demuxer and its streams, DemuxReset() opens it again
+  void CloseInput();
 
   FFmpegExtraData GetPacketExtradata(const AVPacket* pkt, const AVCodecParameters* codecPar);
 
@@ -116,15 +127,19 @@ protected:
   bool m_demuxResetOpenSuccess = false;
   std::string m_streamUrl;
   int m_lastPacketResult;
+  bool m_lastPacketVideoKeyframe = false;
   bool m_isRealTimeStream;
 
 private:
   bool Open(bool fileinfo);
+  void OpenCurlInput();
   bool OpenWithFFmpeg(const AVInputFormat* iformat, const AVIOInterruptCB& int_cb);
   bool OpenWithCURL(const AVInputFormat* iformat);
   AVDictionary* GetFFMpegOptionsFromInput();
   void ResetVideoStreams();
   double ConvertTimestamp(int64_t pts, int den, int num);
+  double ConvertTimestamp(int64_t pts, double timeBase, double starttime);
+  double GetTimestampStartTime() const;
   unsigned int HLSSelectProgram();
   int GetNrOfStreams() const;
   int GetNrOfStreams(INPUTSTREAM_TYPE streamType);
@@ -146,6 +161,8 @@ private:
   bool IsTransportStreamReady();
   bool IsProgramChange();
   void StoreSideData(DEMUX_PACKET *pkt, AVPacket *src);
+  DEMUX_PACKET* DemuxReadPacket(DEMUX_PACKET* sinkPacket);
+  DEMUX_PACKET* AllocateDemuxPacket(IManageDemuxPacket* demuxPacketManager, int dataSize, DEMUX_PACKET* sinkPacket);
 
   bool StreamsOpened() { return m_streams.size() > 0; }
 
@@ -158,6 +175,7 @@ private:
   bool m_paused;
 
   std::map<int, DemuxStream*> m_streams;
+  std::vector<DemuxStream*> m_streamsByIndex; // same streams as m_streams, for the lookup per packet
   std::map<int, std::unique_ptr<DemuxParserFFmpeg>> m_parsers;
 
   AVIOContext* m_ioContext;
@@ -183,8 +201,12 @@ private:
     int      result;    // result from av_read_packet
   }m_pkt;
 
+  // Packet whose data is borrowed by the DEMUX_PACKET handed to a sink
+  AVPacket m_sinkPkt;
+
   bool m_streaminfo;
   bool m_reopen = false;
+  bool m_inputClosed = false;
   bool m_checkTransportStream;
   int m_displayTime = 0;
   double m_dtsAtDisplayTime;
@@ -0,0 +1,29 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <kodi/addon-instance/Inputstream.h>
+
+namespace ffmpegdirect
+{
+
+class IDemuxPacketSink
+{
+public:
+  virtual ~IDemuxPacketSink() = default;
+
+  /*
+   * The packet is not allocated through kodi, its payload and side data belong to the
+   * demuxer and are only valid for the duration of the call. Anything the sink wants to
+   * keep must be copied. As DEMUX_PACKET has no flags the demuxer's keyframe flag is
+   * passed alongside, it is only set for video packets.
+   */
+  virtual void WriteDemuxPacket(const DEMUX_PACKET* packet, bool videoKeyframe) = 0;
+};
+
+} //namespace ffmpegdirect
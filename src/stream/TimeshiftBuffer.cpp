@@ -7,19 +7,47 @@
 
 #include "TimeshiftBuffer.h"
 
+#include "TimeshiftSegmentFormat.h"
+#include "TimeshiftSegmentJanitor.h"
 #include "url/URL.h"
 #include "../utils/DiskUtils.h"
 #include "../utils/Log.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
 #include <kodi/tools/StringUtils.h>
 #include <kodi/Filesystem.h>
 
 using namespace ffmpegdirect;
 using namespace kodi::tools;
 
-TimeshiftBuffer::TimeshiftBuffer(IManageDemuxPacket* demuxPacketManager)
-  : m_demuxPacketManager(demuxPacketManager)
+TimeshiftBuffer::TimeshiftBuffer(const Properties& props)
+  : m_segmentLoader(&m_segmentWriter)
 {
+  // The stream property takes precedence over the setting
+  TimeshiftMode mode = props.m_timeshiftMode;
+  if (mode == TimeshiftMode::DEFAULT)
+    mode = kodi::addon::GetSettingEnum<TimeshiftMode>("timeshiftMode", TimeshiftMode::DISK);
+
+  int memoryBufferSizeMB = DEFAULT_MEMORY_BUFFER_SIZE_MB;
+  if (!kodi::addon::CheckSettingInt("timeshiftMemoryBufferSize", memoryBufferSizeMB) || memoryBufferSizeMB <= 0)
+    memoryBufferSizeMB = DEFAULT_MEMORY_BUFFER_SIZE_MB;
+  m_memoryBufferBudget = static_cast<size_t>(memoryBufferSizeMB) * 1024 * 1024;
+
+  if (mode == TimeshiftMode::MEMORY)
+  {
+    m_memoryOnly = true;
+    m_readAheadSegments = 0;
+
+    Log(LOGLEVEL_INFO, "%s - Timeshift mode 'memory', buffer size set to %d MB", __FUNCTION__, memoryBufferSizeMB);
+    return;
+  }
+
+  Log(LOGLEVEL_INFO, "%s - Timeshift mode 'disk', memory buffer size set to %d MB", __FUNCTION__, memoryBufferSizeMB);
+
   m_timeshiftBufferPath = kodi::addon::GetSettingString("timeshiftBufferPath");
   if (m_timeshiftBufferPath.empty())
   {
@@ -47,40 +75,95 @@ TimeshiftBuffer::TimeshiftBuffer(IManageDemuxPacket* demuxPacketManager)
     Log(LOGLEVEL_INFO, "%s - On disk length limit 'disabled'", __FUNCTION__);
 
   m_maxOnDiskSegments = (onDiskTotalLengthSeconds / TIMESHIFT_SEGMENT_LENGTH_SECS) + 1;
+  m_segmentFilePoolSize = m_maxOnDiskSegments + 1;
+
+  if (!kodi::addon::CheckSettingInt("timeshiftReadAheadSegments", m_readAheadSegments) || m_readAheadSegments < 0)
+    m_readAheadSegments = DEFAULT_READ_AHEAD_SEGMENTS;
+  Log(LOGLEVEL_INFO, "%s - Read ahead of on disk segments set to %d segments", __FUNCTION__, m_readAheadSegments);
+
+  TimeshiftCompression compression = props.m_timeshiftCompression;
+  if (compression == TimeshiftCompression::DEFAULT)
+    compression = kodi::addon::GetSettingEnum<TimeshiftCompression>("timeshiftCompression", TimeshiftCompression::NONE);
+
+  if (compression == TimeshiftCompression::ZLIB)
+    m_segmentFileOptions.m_compression = CompressionMethod::ZLIB;
+  else if (compression == TimeshiftCompression::BZIP2)
+    m_segmentFileOptions.m_compression = CompressionMethod::BZIP2;
+  Log(LOGLEVEL_INFO, "%s - Segment compression set to '%s'", __FUNCTION__, CompressionUtils::GetMethodName(m_segmentFileOptions.m_compression));
+
+  if (!kodi::addon::CheckSettingBoolean("timeshiftLimitPageCache", m_segmentFileOptions.m_limitPageCache))
+    m_segmentFileOptions.m_limitPageCache = true;
+  Log(LOGLEVEL_INFO, "%s - Limit page cache use of segment files '%s'", __FUNCTION__, m_segmentFileOptions.m_limitPageCache ? "enabled" : "disabled");
+
+  if (!kodi::addon::CheckSettingBoolean("timeshiftNativeStorage", m_segmentFileOptions.m_nativeStorage))
+    m_segmentFileOptions.m_nativeStorage = true;
+  m_segmentIndexFileHandle = TimeshiftFile::Create(m_timeshiftBufferPath, m_segmentFileOptions.m_nativeStorage);
+  Log(LOGLEVEL_INFO, "%s - Storage backend for segment files set to '%s'", __FUNCTION__, m_segmentIndexFileHandle->GetBackendName());
 }
 
 TimeshiftBuffer::~TimeshiftBuffer()
 {
-  if (!m_streamId.empty())
+  // Read ahead segments hold open files which would stop them being deleted on windows
+  m_segmentLoader.Stop();
+
+  if (!m_streamId.empty() && !m_memoryOnly)
   {
     //We need to make sure any filehandle is closed as you can't delete an open file on windows
     m_writeSegment->MarkAsComplete();
-    for (int segmentId = m_earliestOnDiskSegmentId; segmentId <= m_writeSegment->GetSegmentId(); segmentId++)
-    {
-      std::string segmentFilename = StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), segmentId);
-      Log(LOGLEVEL_DEBUG, "%s - Deleting on disk segment - Segment ID: %d, Segment Filename: %s", __FUNCTION__, segmentId, segmentFilename.c_str());
 
-      kodi::vfs::DeleteFile(m_timeshiftBufferPath + "/" + segmentFilename);
-    }
+    // Likewise segments can hold a mapping of their file, so release them before queueing the deletes
+    const int lastSegmentId = m_writeSegment->GetSegmentId();
+    m_inMemoryIndex.clear();
+    m_firstSegment.reset();
+    m_writeSegment.reset();
+    for (const auto& cursor : m_cursors)
+      cursor->m_readSegment.reset();
+
+    // Deleting can take seconds on network shares so it's left to the janitor and closing doesn't wait
+    TimeshiftSegmentJanitor& janitor = TimeshiftSegmentJanitor::GetInstance();
+    Log(LOGLEVEL_DEBUG, "%s - Queueing delete of on disk segments - Segment IDs: %d to %d", __FUNCTION__, m_earliestOnDiskSegmentId, lastSegmentId);
+    for (int segmentId = m_earliestOnDiskSegmentId; segmentId <= lastSegmentId; segmentId++)
+      janitor.QueueDelete(m_timeshiftBufferPath + "/" + StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), segmentId));
+    for (const auto& recycledFilePath : m_recycledSegmentFiles)
+      janitor.QueueDelete(recycledFilePath);
   }
 
-  m_segmentIndexFileHandle.Close();
-  kodi::vfs::DeleteFile(m_segmentIndexFilePath);
+  m_segmentWriter.Stop();
+
+  if (!m_segmentIndexFilePath.empty())
+  {
+    m_segmentIndexFileHandle->Close();
+    TimeshiftSegmentJanitor::GetInstance().QueueDelete(m_segmentIndexFilePath);
+    TimeshiftSegmentJanitor::GetInstance().UnregisterStream(m_streamId);
+  }
 }
 
 bool TimeshiftBuffer::Start(const std::string& streamId)
 {
-  m_segmentIndexFilePath = m_timeshiftBufferPath + "/" + streamId + ".idx";
-  // We need to pass the overwrite parameter as true as otherwise
-  // opening on SMB for write on android will fail.
-  if (!m_segmentIndexFileHandle.OpenFileForWrite(m_segmentIndexFilePath, true))
-  {
-    uint64_t freeSpaceMB = 0;
-    if (DiskUtils::GetFreeDiskSpaceMB(m_timeshiftBufferPath, freeSpaceMB))
-      Log(LOGLEVEL_ERROR, "%s - Failed to open segment index file on disk: %s, disk free space (MB): %lld", __FUNCTION__, CURL::GetRedacted(m_segmentIndexFilePath).c_str(), static_cast<long long>(freeSpaceMB));
-    else
-      Log(LOGLEVEL_ERROR, "%s - Failed to open segment index file on disk: %s, not possible to calculate free space", __FUNCTION__, CURL::GetRedacted(m_segmentIndexFilePath).c_str());
-    return false;
+  if (!m_memoryOnly)
+  {
+    m_segmentIndexFilePath = m_timeshiftBufferPath + "/" + streamId + ".idx";
+    if (!m_segmentIndexFileHandle->OpenFileForWrite(m_segmentIndexFilePath))
+    {
+      uint64_t freeSpaceMB = 0;
+      if (DiskUtils::GetFreeDiskSpaceMB(m_timeshiftBufferPath, freeSpaceMB))
+        Log(LOGLEVEL_ERROR, "%s - Failed to open segment index file on disk: %s, disk free space (MB): %lld", __FUNCTION__, CURL::GetRedacted(m_segmentIndexFilePath).c_str(), static_cast<long long>(freeSpaceMB));
+      else
+        Log(LOGLEVEL_ERROR, "%s - Failed to open segment index file on disk: %s, not possible to calculate free space", __FUNCTION__, CURL::GetRedacted(m_segmentIndexFilePath).c_str());
+      return false;
+    }
+
+    SegmentIndexFileHeader indexFileHeader;
+    m_segmentIndexFileHandle->Write(&indexFileHeader, sizeof(indexFileHeader));
+
+    // Files left behind by sessions that were never closed are cleaned up in the background
+    TimeshiftSegmentJanitor::GetInstance().RegisterStream(streamId);
+    TimeshiftSegmentJanitor::GetInstance().QueueOrphanSweep(m_timeshiftBufferPath);
+
+    m_segmentWriter.Start();
+
+    if (m_readAheadSegments > 0)
+      m_segmentLoader.Start(streamId, m_timeshiftBufferPath, m_segmentFileOptions);
   }
 
   m_streamId = streamId;
@@ -88,20 +171,56 @@ bool TimeshiftBuffer::Start(const std::string& streamId)
   m_startedTimePoint = std::chrono::high_resolution_clock::now();
   m_startTime = std::time(nullptr);
 
-  m_firstSegment = std::make_shared<TimeshiftSegment>(m_demuxPacketManager, m_streamId, m_currentSegmentIndex, m_timeshiftBufferPath);
+  m_firstSegment = CreateWriteSegment();
   m_writeSegment = m_firstSegment;
-  m_segmentTimeIndexMap[0] = m_writeSegment;
+  m_inMemoryIndex.push_back({0, m_writeSegment});
   m_currentSegmentIndex++;
   m_segmentTotalCount++;
-  m_readSegment = m_writeSegment;
 
   return true;
 }
 
-void TimeshiftBuffer::AddPacket(DEMUX_PACKET* packet)
+std::shared_ptr<TimeshiftReadCursor> TimeshiftBuffer::AddReader(IManageDemuxPacket* demuxPacketManager)
 {
+  std::shared_ptr<TimeshiftReadCursor> cursor = std::make_shared<TimeshiftReadCursor>(demuxPacketManager);
+
   std::lock_guard<std::mutex> lock(m_mutex);
 
+  cursor->m_readSegment = m_writeSegment;
+  cursor->m_readSegmentId = m_writeSegment->GetSegmentId();
+  cursor->m_currentDemuxTimeIndex = m_inMemoryIndex.back().m_timeIndexStart;
+  m_cursors.emplace_back(cursor);
+
+  Log(LOGLEVEL_DEBUG, "%s - Added reader at segment ID: %d, reader count: %d", __FUNCTION__, m_writeSegment->GetSegmentId(), static_cast<int>(m_cursors.size()));
+
+  return cursor;
+}
+
+void TimeshiftBuffer::RemoveReader(const std::shared_ptr<TimeshiftReadCursor>& cursor)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = std::find(m_cursors.begin(), m_cursors.end(), cursor);
+    if (it == m_cursors.end())
+      return;
+
+    m_cursors.erase(it);
+    cursor->m_readSegment.reset();
+    cursor->m_readSegmentId = -1;
+
+    Log(LOGLEVEL_DEBUG, "%s - Removed reader, reader count: %d", __FUNCTION__, static_cast<int>(m_cursors.size()));
+  }
+
+  // Releases the segments read ahead for the reader
+  m_segmentLoader.RequestSegments(cursor.get(), 0, -1);
+}
+
+void TimeshiftBuffer::AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe)
+{
+  // Everything here is only used by the ingest thread, the lock is only taken to
+  // change the segments the reader can see when a new segment is started
+
   // Useful for debugging the initial set of packets in a stream
   if (m_readingInitialPackets)
   {
@@ -112,168 +231,363 @@ void TimeshiftBuffer::AddPacket(DEMUX_PACKET* packet)
       m_readingInitialPackets = false;
   }
 
-  int secondsSinceStart = 0;
-  if (packet->pts != STREAM_NOPTS_VALUE && packet->pts > 0)
-    secondsSinceStart = packet->pts / STREAM_TIME_BASE;
+  const int64_t timeIndex = PtsToTimeIndexMs(packet->pts);
+
+  if (videoKeyframe)
+    m_hasVideoKeyframes = true;
 
-  if (secondsSinceStart - m_lastSegmentSecondsSinceStart >= TIMESHIFT_SEGMENT_LENGTH_SECS)
+  bool startNewSegment = false;
+  const int64_t segmentLengthMs = timeIndex - m_lastSegmentTimeIndex;
+  if (segmentLengthMs >= TIMESHIFT_SEGMENT_LENGTH_MS)
   {
     m_readingInitialPackets = false;
 
-    if (secondsSinceStart != m_lastPacketSecondsSinceStart)
+    // For video a new segment waits for the next keyframe so each segment starts at a point
+    // the decoder can start from, unless the keyframes are so far apart the maximum is reached.
+    // Without video a segment ends on the first packet with a new time.
+    if (m_hasVideoKeyframes && segmentLengthMs < TIMESHIFT_SEGMENT_MAX_LENGTH_MS)
+      startNewSegment = videoKeyframe;
+    else
+      startNewSegment = timeIndex != m_lastPacketTimeIndex;
+  }
+
+  // However long it is a segment can only hold so many packets
+  if (m_writeSegment->IsFull())
+    startNewSegment = true;
+
+  if (startNewSegment)
+  {
+    m_readingInitialPackets = false;
+
+    std::shared_ptr<TimeshiftSegment> previousWriteSegment = m_writeSegment;
+
+    Log(LOGLEVEL_DEBUG, "%s - Writing new segment - ms: %lld, last seg ms: %lld, last seg packet count: %d, new seg index: %d, keyframe: %s, pts %.2f, dts: %.2f, pts sec: %.0f, dts sec: %.0f",
+                       __FUNCTION__, static_cast<long long>(timeIndex), static_cast<long long>(m_lastSegmentTimeIndex), previousWriteSegment->GetPacketCount(), m_currentSegmentIndex, videoKeyframe ? "true" : "false",
+                       packet->pts, packet->dts, packet->pts / STREAM_TIME_BASE, packet->dts / STREAM_TIME_BASE);
+
+    // The new segment is linked before the previous one is complete, so a reader that has
+    // read all of the previous segment always finds the next one. Completing a segment waits
+    // for its data to be written, which is why it's done before taking the lock.
+    std::shared_ptr<TimeshiftSegment> nextWriteSegment = CreateWriteSegment();
+    previousWriteSegment->SetNextSegment(nextWriteSegment);
+    previousWriteSegment->MarkAsComplete();
+
+    if (!m_memoryOnly)
     {
-      m_readingInitialPackets = false;
+      SegmentIndexOnDiskEntry indexEntry;
+      indexEntry.m_segmentId = previousWriteSegment->GetSegmentId();
+      indexEntry.m_timeIndexStart = m_lastSegmentTimeIndex;
+      indexEntry.m_timeIndexEnd = timeIndex;
+      indexEntry.m_byteSize = previousWriteSegment->GetFileSize();
+      AddToOnDiskIndex(indexEntry);
+    }
 
-      std::shared_ptr<TimeshiftSegment> m_previousWriteSegment = m_writeSegment;
-      m_previousWriteSegment->MarkAsComplete();
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-      Log(LOGLEVEL_DEBUG, "%s - Writing new segment - seconds: %d, last seg seconds: %d, last seg packet count: %d, new seg index: %d, pts %.2f, dts: %.2f, pts sec: %.0f, dts sec: %.0f",
-                         __FUNCTION__, secondsSinceStart, m_lastSegmentSecondsSinceStart, m_previousWriteSegment->GetPacketCount(), m_currentSegmentIndex,
-                         packet->pts, packet->dts, packet->pts / STREAM_TIME_BASE, packet->dts / STREAM_TIME_BASE);
+    RemoveSegmentsOverMemoryBudget();
 
-      if (m_segmentIndexFileHandle.IsOpen())
-      {
-        std::string line = StringUtils::Format("%9d,%9d,%9d\n", m_previousWriteSegment->GetSegmentId(), m_lastSegmentSecondsSinceStart, secondsSinceStart); // 30 characters per line
-        m_segmentIndexFileHandle.Write(line.c_str(), line.length());
-      }
+    m_writeSegment = nextWriteSegment;
+    m_inMemoryIndex.push_back({timeIndex, m_writeSegment});
+    m_currentSegmentIndex++;
+    m_segmentTotalCount++;
+    m_lastSegmentTimeIndex = timeIndex;
+  }
+  m_lastPacketTimeIndex = timeIndex;
+
+  m_writeSegment->AddPacket(packet, videoKeyframe);
+}
 
-      if (m_segmentTimeIndexMap.size() > MAX_IN_MEMORY_SEGMENT_INDEXES)
-        RemoveOldestInMemoryAndOnDiskSegments();
+std::shared_ptr<TimeshiftSegment> TimeshiftBuffer::CreateWriteSegment()
+{
+  if (m_memoryOnly)
+    return std::make_shared<TimeshiftSegment>(m_streamId, m_currentSegmentIndex);
 
-      m_writeSegment = std::make_shared<TimeshiftSegment>(m_demuxPacketManager, m_streamId, m_currentSegmentIndex, m_timeshiftBufferPath);
-      m_previousWriteSegment->SetNextSegment(m_writeSegment);
-      m_segmentTimeIndexMap[secondsSinceStart] = m_writeSegment;
-      m_currentSegmentIndex++;
-      m_segmentTotalCount++;
-      m_lastSegmentSecondsSinceStart = secondsSinceStart;
+  std::string recycledFilePath;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_recycledSegmentFiles.empty())
+    {
+      recycledFilePath = m_recycledSegmentFiles.front();
+      m_recycledSegmentFiles.pop_front();
     }
   }
-  m_lastPacketSecondsSinceStart = secondsSinceStart;
 
-  m_writeSegment->AddPacket(packet);
+  // Renaming a file from the pool replaces creating a new file and deleting an old one
+  bool recycledFile = false;
+  if (!recycledFilePath.empty())
+  {
+    const std::string segmentFilePath = m_timeshiftBufferPath + "/" + StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), m_currentSegmentIndex);
+    recycledFile = kodi::vfs::RenameFile(recycledFilePath, segmentFilePath);
+    if (!recycledFile)
+    {
+      Log(LOGLEVEL_DEBUG, "%s - Failed to recycle segment file: %s", __FUNCTION__, CURL::GetRedacted(recycledFilePath).c_str());
+      TimeshiftSegmentJanitor::GetInstance().QueueDelete(recycledFilePath);
+    }
+  }
+
+  // The next segment is expected to be about the size of the last one, compressed sizes are too variable to guess
+  int64_t preallocateSize = 0;
+  if (m_writeSegment && m_segmentFileOptions.m_compression == CompressionMethod::NONE)
+    preallocateSize = m_writeSegment->GetFileSize();
+
+  return std::make_shared<TimeshiftSegment>(&m_segmentWriter, m_streamId, m_currentSegmentIndex, m_timeshiftBufferPath, m_segmentFileOptions, recycledFile, preallocateSize);
 }
 
-void TimeshiftBuffer::RemoveOldestInMemoryAndOnDiskSegments()
+void TimeshiftBuffer::RemoveOldestInMemorySegment()
 {
   std::shared_ptr<TimeshiftSegment> oldFirstSegment = m_firstSegment;
 
   m_firstSegment = oldFirstSegment->GetNextSegment();
   oldFirstSegment->SetNextSegment(nullptr);
-  int timeToRemove = m_segmentTimeIndexMap.cbegin()->first;
-  m_segmentTimeIndexMap.erase(timeToRemove);
-  m_minInMemorySeekTimeIndex = m_segmentTimeIndexMap.cbegin()->first;
+  m_inMemoryIndex.erase(m_inMemoryIndex.begin());
+  m_minInMemorySeekTimeIndex = m_inMemoryIndex.front().m_timeIndexStart;
 
   Log(LOGLEVEL_DEBUG, "%s - Removed oldest in memory segment with ID: %d", __FUNCTION__, oldFirstSegment->GetSegmentId());
+}
+
+void TimeshiftBuffer::RemoveSegmentsOverMemoryBudget()
+{
+  // The size of a segment depends on the bitrate so the actual usage is measured
+  size_t memoryUsed = 0;
+  for (const auto& indexEntry : m_inMemoryIndex)
+    memoryUsed += indexEntry.m_segment->GetMemorySize();
+
+  // Segments are removed from memory even when paused, only on disk segments are kept for a paused
+  // reader. In memory segments are also kept below the on disk limit as that's the length of the
+  // whole buffer. The segment just completed is always kept.
+  while (m_inMemoryIndex.size() > 1 &&
+         (memoryUsed > m_memoryBufferBudget ||
+          (!m_memoryOnly && m_enableOnDiskSegmentLimit && static_cast<int>(m_inMemoryIndex.size()) >= m_maxOnDiskSegments)))
+  {
+    memoryUsed -= m_firstSegment->GetMemorySize();
 
-  if (m_enableOnDiskSegmentLimit && !m_paused &&
+    if (m_memoryOnly)
+      RemoveOldestInMemorySegment();
+    else
+      RemoveOldestInMemoryAndOnDiskSegments();
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - In memory segments: %d, memory used: %lld bytes", __FUNCTION__, static_cast<int>(m_inMemoryIndex.size()), static_cast<long long>(memoryUsed));
+}
+
+void TimeshiftBuffer::RemoveOldestInMemoryAndOnDiskSegments()
+{
+  RemoveOldestInMemorySegment();
+
+  // On disk segments are kept for the reader furthest behind, and all of them while any reader is paused
+  bool paused = false;
+  int64_t currentDemuxTimeIndex = INT64_MAX;
+  int minReadSegmentId = INT_MAX;
+  for (const auto& cursor : m_cursors)
+  {
+    paused = paused || cursor->m_paused;
+    currentDemuxTimeIndex = std::min(currentDemuxTimeIndex, cursor->m_currentDemuxTimeIndex.load());
+    if (cursor->m_readSegmentId >= 0)
+      minReadSegmentId = std::min(minReadSegmentId, cursor->m_readSegmentId.load());
+  }
+
+  if (m_enableOnDiskSegmentLimit && !paused &&
       m_segmentTotalCount > m_maxOnDiskSegments &&
-      m_currentDemuxTimeIndex > m_minOnDiskSeekTimeIndex)
+      currentDemuxTimeIndex > m_minOnDiskSeekTimeIndex)
   {
-    while (m_segmentTotalCount > m_maxOnDiskSegments && m_currentDemuxTimeIndex > m_minOnDiskSeekTimeIndex)
+    while (m_segmentTotalCount > m_maxOnDiskSegments && currentDemuxTimeIndex > m_minOnDiskSeekTimeIndex)
     {
+      const int removedSegmentId = m_earliestOnDiskSegmentId;
       std::string segmentFilename = StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), m_earliestOnDiskSegmentId);
-      if (kodi::vfs::FileExists(m_timeshiftBufferPath + "/" + segmentFilename))
-      {
-        kodi::vfs::DeleteFile(m_timeshiftBufferPath + "/" + segmentFilename);
-        Log(LOGLEVEL_DEBUG, "%s - Removed oldest on disk segment with ID: %d - currentDemuxTimeSeconds: %d, min on disk time: %d", __FUNCTION__, m_earliestOnDiskSegmentId, m_currentDemuxTimeIndex, m_minOnDiskSeekTimeIndex);
-        m_earliestOnDiskSegmentId++;
-        m_segmentTotalCount--;
-
-        SegmentIndexOnDiskEntry indexEntry = SearchOnDiskIndex(SegmentIndexSearchBy::SEGMENT_ID, m_earliestOnDiskSegmentId);
-
-        if (indexEntry.m_segmentId >= 0)
-          m_minOnDiskSeekTimeIndex = indexEntry.m_timeIndexStart;
-      }
+      Log(LOGLEVEL_DEBUG, "%s - Removed oldest on disk segment with ID: %d - currentDemuxTimeMs: %lld, min on disk time ms: %lld", __FUNCTION__, m_earliestOnDiskSegmentId, static_cast<long long>(currentDemuxTimeIndex), static_cast<long long>(m_minOnDiskSeekTimeIndex));
+      m_earliestOnDiskSegmentId++;
+      m_segmentTotalCount--;
+
+      // The pool holds one file more than the on disk segments so the next segment can always be
+      // written to a recycled file. Anything beyond that is deleted by the janitor so the ingest
+      // thread never waits on storage here. A file is only recycled once every reader has moved past
+      // it, as overwriting a file which is still mapped for reading is not safe.
+      if (m_segmentTotalCount + static_cast<int>(m_recycledSegmentFiles.size()) < m_segmentFilePoolSize &&
+          minReadSegmentId != INT_MAX && minReadSegmentId > removedSegmentId)
+        m_recycledSegmentFiles.emplace_back(m_timeshiftBufferPath + "/" + segmentFilename);
+      else
+        TimeshiftSegmentJanitor::GetInstance().QueueDelete(m_timeshiftBufferPath + "/" + segmentFilename);
+
+      while (!m_onDiskIndex.empty() && m_onDiskIndex.front().m_segmentId < m_earliestOnDiskSegmentId)
+        m_onDiskIndex.pop_front();
+
+      SegmentIndexOnDiskEntry indexEntry = SearchOnDiskIndex(SegmentIndexSearchBy::SEGMENT_ID, m_earliestOnDiskSegmentId);
+
+      if (indexEntry.m_segmentId >= 0)
+        m_minOnDiskSeekTimeIndex = indexEntry.m_timeIndexStart;
     }
   }
 }
 
-DEMUX_PACKET* TimeshiftBuffer::ReadPacket()
+DEMUX_PACKET* TimeshiftBuffer::ReadPacket(TimeshiftReadCursor& cursor, bool* videoKeyframe)
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-  DEMUX_PACKET* packet = nullptr;
+  if (videoKeyframe)
+    *videoKeyframe = false;
 
-  if (m_readSegment)
-  {
-    m_readSegment->LoadSegment();
+  if (cursor.m_trickPlaySpeed != 0)
+    return ReadTrickPlayPacket(cursor);
+
+  if (!cursor.m_readSegment)
+    return cursor.m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+
+  // No lock is taken per packet, the read segment is only changed by this thread and the
+  // ingest thread publishes packets lock free. The buffer's lock is only taken to move on.
+  cursor.m_readSegment->LoadSegment();
+
+  DEMUX_PACKET* packet = cursor.m_readSegment->ReadPacket(cursor.m_demuxPacketManager, cursor.m_readPosition, videoKeyframe);
+
+  if (!cursor.m_readSegment->HasPacketAvailable(cursor.m_readPosition) && cursor.m_readSegment->ReadAllPackets(cursor.m_readPosition))
+    MoveToNextSegment(cursor);
+
+  if (packet && packet->pts != STREAM_NOPTS_VALUE && packet->pts > 0)
+    cursor.m_currentDemuxTimeIndex = PtsToTimeIndexMs(packet->pts);
+
+  return packet;
+}
+
+void TimeshiftBuffer::MoveToNextSegment(TimeshiftReadCursor& cursor)
+{
+  std::shared_ptr<TimeshiftSegment> previousReadSegment = cursor.m_readSegment;
+  std::shared_ptr<TimeshiftSegment> nextReadSegment = previousReadSegment->GetNextSegment();
+  const int nextSegmentId = previousReadSegment->GetSegmentId() + 1;
 
-    packet = m_readSegment->ReadPacket();
+  {
+    // Publishing the segment ID and checking the other cursors' IDs happen under the lock,
+    // so a segment can't be cleared while another reader moves on to it
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-    if (!m_readSegment->HasPacketAvailable() && m_readSegment->ReadAllPackets())
+    if (!nextReadSegment && m_memoryOnly)
     {
-      std::shared_ptr<TimeshiftSegment> m_previousReadSegment = m_readSegment;
-
-      m_readSegment = m_readSegment->GetNextSegment();
-      if (!m_readSegment) // We need to load the next read segment from disk as it doesn't exist in memory
-      {
-        m_readSegment = std::make_shared<TimeshiftSegment>(m_demuxPacketManager, m_streamId, m_previousReadSegment->GetSegmentId() + 1, m_timeshiftBufferPath);
-        m_readSegment->ForceLoadSegment();
-      }
-      m_readSegment->ResetReadIndex();
-
-      m_previousReadSegment->ClearPackets();
-      if (m_readSegment)
-        Log(LOGLEVEL_DEBUG, "%s - Reading next segment with id: %d, packet count: %d", __FUNCTION__, m_readSegment->GetSegmentId(), m_readSegment->GetPacketCount());
+      // The reader fell behind the start of the buffer, continue from the oldest segment left
+      nextReadSegment = m_firstSegment;
+      Log(LOGLEVEL_DEBUG, "%s - Read segment with id: %d was removed from memory, continuing from id: %d", __FUNCTION__, previousReadSegment->GetSegmentId(), nextReadSegment->GetSegmentId());
     }
+    cursor.m_readSegmentId = nextReadSegment ? nextReadSegment->GetSegmentId() : nextSegmentId;
 
-    if (packet && packet->pts != STREAM_NOPTS_VALUE && packet->pts > 0)
-      m_currentDemuxTimeIndex = packet->pts / STREAM_TIME_BASE;
+    // Another reader could still be part way through the segment
+    if (!IsReadByOtherCursor(cursor, previousReadSegment->GetSegmentId()))
+      previousReadSegment->ClearPackets();
   }
-  else
+
+  if (!nextReadSegment) // We need to load the next read segment from disk as it doesn't exist in memory
   {
-    packet = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+    // Normally the read ahead has already loaded it, only fall back to loading it here if not.
+    // The published ID stops the file being recycled while it loads without holding the lock.
+    nextReadSegment = m_segmentLoader.TakeSegment(nextSegmentId);
+    if (!nextReadSegment)
+    {
+      nextReadSegment = std::make_shared<TimeshiftSegment>(&m_segmentWriter, m_streamId, nextSegmentId, m_timeshiftBufferPath, m_segmentFileOptions);
+      nextReadSegment->ForceLoadSegment();
+    }
   }
 
-  return packet;
+  cursor.m_readSegment = nextReadSegment;
+  cursor.m_readPosition = TimeshiftSegmentReadPosition();
+  RequestReadAhead(cursor);
+
+  Log(LOGLEVEL_DEBUG, "%s - Reading next segment with id: %d, packet count: %d", __FUNCTION__, cursor.m_readSegment->GetSegmentId(), cursor.m_readSegment->GetPacketCount());
 }
 
-bool TimeshiftBuffer::Seek(double timeMs)
+bool TimeshiftBuffer::Seek(TimeshiftReadCursor& cursor, double timeMs)
 {
-  int seekSeconds = timeMs / 1000;
-  std::lock_guard<std::mutex> lock(m_mutex);
+  int64_t seekMs = static_cast<int64_t>(timeMs);
 
-  if (seekSeconds < 0)
-      seekSeconds = m_minOnDiskSeekTimeIndex;
-
-  if (seekSeconds >= m_minInMemorySeekTimeIndex)
+  if (seekMs < 0)
   {
-    auto seekSegmentIndex = m_segmentTimeIndexMap.upper_bound(seekSeconds);
-    // Upper bound gets the segment after the one we want
-    if (seekSegmentIndex != m_segmentTimeIndexMap.begin())
-      --seekSegmentIndex;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    seekMs = m_memoryOnly ? m_minInMemorySeekTimeIndex : m_minOnDiskSeekTimeIndex;
+  }
 
-    if (seekSegmentIndex != m_segmentTimeIndexMap.end())
-      m_readSegment = seekSegmentIndex->second;
-    else // Jump to live segment
-      m_readSegment = m_segmentTimeIndexMap.rbegin()->second;
+  // During trick play stepping carries on from the seek position
+  if (cursor.m_trickPlaySpeed != 0)
+  {
+    cursor.m_trickPlayStartTimeIndex = seekMs;
+    cursor.m_trickPlayStartTime = std::chrono::steady_clock::now();
+    cursor.m_lastTrickPlayFrameTime = std::chrono::steady_clock::time_point();
+    cursor.m_lastTrickPlayPts = STREAM_NOPTS_VALUE;
+  }
 
-    Log(LOGLEVEL_DEBUG, "%s - Buffer - SegmentID: %d, SeekSeconds: %d", __FUNCTION__, m_readSegment->GetSegmentId(), seekSeconds);
+  return SeekToTimeIndex(cursor, seekMs, cursor.m_trickPlaySpeed == 0);
+}
 
-    m_readSegment->LoadSegment();
-    if (m_readSegment->Seek(timeMs))
-      return true;
-  }
-  else // We need to find the segment in the index file as it's not in memory
+bool TimeshiftBuffer::SeekToTimeIndex(TimeshiftReadCursor& cursor, int64_t seekMs, bool readAhead)
+{
+  // The segment is found under the lock, loading it from disk and seeking within it is done without
+  std::shared_ptr<TimeshiftSegment> seekSegment;
+  bool inMemory = false;
+  int onDiskSegmentId = -1;
+  const int previousReadSegmentId = cursor.m_readSegmentId;
+  const int64_t previousDemuxTimeIndex = cursor.m_currentDemuxTimeIndex;
   {
-    SegmentIndexOnDiskEntry indexEntry = SearchOnDiskIndex(SegmentIndexSearchBy::TIME_INDEX, seekSeconds);
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-    if (indexEntry.m_segmentId >= 0)
+    if (seekMs >= m_minInMemorySeekTimeIndex)
+    {
+      // Upper bound gets the segment after the one we want
+      auto seekSegmentIndex = std::upper_bound(m_inMemoryIndex.cbegin(), m_inMemoryIndex.cend(), seekMs,
+                                               [](int64_t timeIndex, const SegmentIndexInMemoryEntry& entry) { return timeIndex < entry.m_timeIndexStart; });
+      if (seekSegmentIndex != m_inMemoryIndex.cbegin())
+        --seekSegmentIndex;
+
+      if (seekSegmentIndex != m_inMemoryIndex.cend())
+        seekSegment = seekSegmentIndex->m_segment;
+      else // Jump to live segment
+        seekSegment = m_inMemoryIndex.back().m_segment;
+      inMemory = true;
+
+      if (readAhead)
+        Log(LOGLEVEL_DEBUG, "%s - Buffer - SegmentID: %d, SeekMs: %lld", __FUNCTION__, seekSegment->GetSegmentId(), static_cast<long long>(seekMs));
+    }
+    else if (!m_memoryOnly) // We need to find the segment in the index file as it's not in memory
     {
-      std::string segmentFilename = StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), indexEntry.m_segmentId);
-
-      if (kodi::vfs::FileExists(m_timeshiftBufferPath + "/" + segmentFilename))
-      {
-        m_readSegment = std::make_shared<TimeshiftSegment>(m_demuxPacketManager, m_streamId, indexEntry.m_segmentId, m_timeshiftBufferPath);
-        m_readSegment->ForceLoadSegment();
-        return true;
-      }
+      SegmentIndexOnDiskEntry indexEntry = SearchOnDiskIndex(SegmentIndexSearchBy::TIME_INDEX, seekMs);
+
+      // Already reading the segment, e.g. consecutive trick play steps, so there's no need to load it again
+      if (indexEntry.m_segmentId >= 0 && cursor.m_readSegment && cursor.m_readSegment->GetSegmentId() == indexEntry.m_segmentId)
+        seekSegment = cursor.m_readSegment;
+      else
+        onDiskSegmentId = indexEntry.m_segmentId;
     }
+
+    if (!seekSegment && onDiskSegmentId < 0)
+      return false;
+
+    // Published before loading so the segment's file is kept until the reader has moved past it
+    cursor.m_readSegmentId = seekSegment ? seekSegment->GetSegmentId() : onDiskSegmentId;
+    cursor.m_currentDemuxTimeIndex = seekMs;
   }
 
-  return false;
+  if (seekSegment)
+  {
+    cursor.m_readSegment = seekSegment;
+    cursor.m_readSegment->LoadSegment();
+    if (readAhead)
+      RequestReadAhead(cursor);
+    // A segment from disk without a time index starts from its first packet instead
+    return cursor.m_readSegment->Seek(static_cast<double>(seekMs), cursor.m_readPosition) || !inMemory;
+  }
+
+  std::string segmentFilename = StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), onDiskSegmentId);
+
+  if (!kodi::vfs::FileExists(m_timeshiftBufferPath + "/" + segmentFilename))
+  {
+    // Carry on reading from where the cursor was
+    std::lock_guard<std::mutex> lock(m_mutex);
+    cursor.m_readSegmentId = previousReadSegmentId;
+    cursor.m_currentDemuxTimeIndex = previousDemuxTimeIndex;
+    return false;
+  }
+
+  cursor.m_readSegment = std::make_shared<TimeshiftSegment>(&m_segmentWriter, m_streamId, onDiskSegmentId, m_timeshiftBufferPath, m_segmentFileOptions);
+  cursor.m_readSegment->ForceLoadSegment();
+  if (readAhead)
+    RequestReadAhead(cursor);
+  // Segments with a footer have a time index so we can start at the right packet
+  cursor.m_readSegment->Seek(static_cast<double>(seekMs), cursor.m_readPosition);
+  return true;
 }
 
-void TimeshiftBuffer::SetPaused(bool paused)
+void TimeshiftBuffer::SetPaused(TimeshiftReadCursor& cursor, bool paused)
 {
   std::lock_guard<std::mutex> lock(m_mutex);
 
@@ -281,57 +595,185 @@ void TimeshiftBuffer::SetPaused(bool paused)
   {
     // If the read segment is not in memory clear it's next pointer so stays only on disk
     // Otherwise the the shared pointer will stay referenced.
-    if (m_readSegment->GetSegmentId() < m_firstSegment->GetSegmentId())
-      m_readSegment->SetNextSegment(nullptr);
+    if (cursor.m_readSegment->GetSegmentId() < m_firstSegment->GetSegmentId())
+      cursor.m_readSegment->SetNextSegment(nullptr);
+  }
+
+  Log(LOGLEVEL_INFO, "%s - Stream %s - time ms: %lld", __FUNCTION__, paused ? "paused" : "resumed", static_cast<long long>(cursor.m_currentDemuxTimeIndex));
+
+  cursor.m_paused = paused;
+}
+
+void TimeshiftBuffer::SetSpeed(TimeshiftReadCursor& cursor, int speed)
+{
+  // Pausing is handled by SetPaused() and without video keyframes there's nothing to step through
+  int trickPlaySpeed = speed;
+  if (speed == STREAM_PLAYSPEED_NORMAL || speed == STREAM_PLAYSPEED_PAUSE || !m_hasVideoKeyframes)
+    trickPlaySpeed = 0;
+
+  if (trickPlaySpeed == cursor.m_trickPlaySpeed)
+    return;
+
+  if (trickPlaySpeed != 0)
+  {
+    // A change of speed during trick play continues from the keyframe last read
+    if (cursor.m_trickPlaySpeed == 0 || cursor.m_lastTrickPlayPts == STREAM_NOPTS_VALUE)
+      cursor.m_trickPlayStartTimeIndex = cursor.m_currentDemuxTimeIndex;
+    else
+      cursor.m_trickPlayStartTimeIndex = PtsToTimeIndexMs(cursor.m_lastTrickPlayPts);
+
+    if (cursor.m_trickPlaySpeed == 0)
+      cursor.m_lastTrickPlayPts = STREAM_NOPTS_VALUE;
+
+    cursor.m_trickPlayStartTime = std::chrono::steady_clock::now();
+    cursor.m_lastTrickPlayFrameTime = std::chrono::steady_clock::time_point();
+
+    // Keyframes are read on demand, reading whole segments ahead would be wasted
+    if (m_readAheadSegments > 0)
+      m_segmentLoader.RequestSegments(&cursor, 0, -1);
+  }
+  else
+  {
+    // The read position is just after the last keyframe read, so normal playback carries on from there
+    RequestReadAhead(cursor);
   }
 
-  Log(LOGLEVEL_INFO, "%s - Stream %s - time seconds: %d", __FUNCTION__, paused ? "paused" : "resumed", m_currentDemuxTimeIndex);
+  Log(LOGLEVEL_INFO, "%s - Trick play speed: %d, time ms: %lld", __FUNCTION__, trickPlaySpeed, static_cast<long long>(cursor.m_currentDemuxTimeIndex));
 
-  m_paused = paused;
+  cursor.m_trickPlaySpeed = trickPlaySpeed;
 }
 
-SegmentIndexOnDiskEntry TimeshiftBuffer::SearchOnDiskIndex(const SegmentIndexSearchBy& segmentIndexSearchBy, int searchValue)
+DEMUX_PACKET* TimeshiftBuffer::ReadTrickPlayPacket(TimeshiftReadCursor& cursor)
 {
-  SegmentIndexOnDiskEntry entry;
+  // When no keyframe is due an empty packet is returned, as for a reader waiting on ingest
+  const auto now = std::chrono::steady_clock::now();
+  if (now - cursor.m_lastTrickPlayFrameTime < std::chrono::milliseconds(TRICK_PLAY_FRAME_INTERVAL_MS))
+    return cursor.m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
 
-  int seekStart = 0;
-  // Here we calulate an exact line number for segment id search
-  // and a definitely below line number for time index searches
+  const int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - cursor.m_trickPlayStartTime).count();
+  int64_t timeIndex = cursor.m_trickPlayStartTimeIndex + elapsedMs * cursor.m_trickPlaySpeed / STREAM_PLAYSPEED_NORMAL;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_inMemoryIndex.empty())
+      return cursor.m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+
+    // Stop at either end of the buffer, the start of the live segment is the latest keyframe which is complete
+    const int64_t earliestTimeIndex = m_memoryOnly ? m_minInMemorySeekTimeIndex : m_minOnDiskSeekTimeIndex;
+    const int64_t latestTimeIndex = m_inMemoryIndex.back().m_timeIndexStart;
+    timeIndex = std::max(earliestTimeIndex, std::min(timeIndex, latestTimeIndex));
+  }
+
+  // A seek moves the read position to the keyframe at or before the time, the keyframe
+  // index means only the packets of the keyframes actually shown are ever loaded
+  if (!SeekToTimeIndex(cursor, timeIndex, false))
+    return cursor.m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+
+  // A segment from disk without a time index starts from its first packet, which may not be
+  // a video keyframe, so step on to the first one left in the segment
+  DEMUX_PACKET* packet = nullptr;
+  bool videoKeyframe = false;
+  while (cursor.m_readSegment->HasPacketAvailable(cursor.m_readPosition))
+  {
+    packet = cursor.m_readSegment->ReadPacket(cursor.m_demuxPacketManager, cursor.m_readPosition, &videoKeyframe);
+    if (!packet || videoKeyframe)
+      break;
+
+    cursor.m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(packet);
+    packet = nullptr;
+  }
+
+  // No keyframe was found or still on the keyframe last read
+  if (!packet || packet->pts == cursor.m_lastTrickPlayPts)
+  {
+    if (packet)
+      cursor.m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(packet);
+    return cursor.m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+  }
+
+  cursor.m_lastTrickPlayPts = packet->pts;
+  cursor.m_lastTrickPlayFrameTime = now;
+  if (packet->pts != STREAM_NOPTS_VALUE && packet->pts > 0)
+    cursor.m_currentDemuxTimeIndex = PtsToTimeIndexMs(packet->pts);
+
+  return packet;
+}
+
+void TimeshiftBuffer::RequestReadAhead(TimeshiftReadCursor& cursor)
+{
+  if (m_readAheadSegments <= 0 || !cursor.m_readSegment)
+    return;
+
+  int firstInMemorySegmentId;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_firstSegment)
+      return;
+    firstInMemorySegmentId = m_firstSegment->GetSegmentId();
+  }
+
+  // Only segments which are no longer in memory need to be read ahead, an empty range releases any loaded ones
+  const int firstSegmentId = cursor.m_readSegment->GetSegmentId() + 1;
+  const int lastSegmentId = std::min(cursor.m_readSegment->GetSegmentId() + m_readAheadSegments, firstInMemorySegmentId - 1);
+
+  m_segmentLoader.RequestSegments(&cursor, firstSegmentId, lastSegmentId);
+}
+
+bool TimeshiftBuffer::IsReadByOtherCursor(const TimeshiftReadCursor& cursor, int segmentId)
+{
+  return std::any_of(m_cursors.cbegin(), m_cursors.cend(),
+                     [&](const std::shared_ptr<TimeshiftReadCursor>& otherCursor) { return otherCursor.get() != &cursor && otherCursor->m_readSegmentId == segmentId; });
+}
+
+void TimeshiftBuffer::AddToOnDiskIndex(const SegmentIndexOnDiskEntry& entry)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_onDiskIndex.emplace_back(entry);
+  }
+
+  // The on disk copy is only needed to recover the timeline after a crash, so the
+  // write is queued behind the segment data rather than done on the ingest thread.
+  // Queueing can wait for the disk to catch up so it's done without holding the lock.
+  if (m_segmentIndexFileHandle->IsOpen())
+  {
+    SegmentIndexRecord record;
+    record.m_segmentId = entry.m_segmentId;
+    record.m_timeIndexStart = entry.m_timeIndexStart;
+    record.m_timeIndexEnd = entry.m_timeIndexEnd;
+    record.m_byteSize = entry.m_byteSize;
+
+    std::vector<uint8_t> recordData(sizeof(record));
+    memcpy(recordData.data(), &record, sizeof(record));
+    m_segmentWriter.QueueWrite(m_segmentIndexFileHandle.get(), std::move(recordData));
+  }
+}
+
+SegmentIndexOnDiskEntry TimeshiftBuffer::SearchOnDiskIndex(const SegmentIndexSearchBy& segmentIndexSearchBy, int64_t searchValue)
+{
+  // Segment IDs and time indexes both increase with every segment, so either can be binary searched
   if (segmentIndexSearchBy == SegmentIndexSearchBy::SEGMENT_ID)
-    seekStart = searchValue * SEGMENT_INDEX_FILE_LINE_LENGTH;
-  else if (segmentIndexSearchBy == SegmentIndexSearchBy::TIME_INDEX)
-    seekStart = searchValue / TIMESHIFT_SEGMENT_LENGTH_SECS;
+  {
+    auto it = std::lower_bound(m_onDiskIndex.cbegin(), m_onDiskIndex.cend(), searchValue,
+                               [](const SegmentIndexOnDiskEntry& entry, int64_t segmentId) { return entry.m_segmentId < segmentId; });
 
-  kodi::vfs::CFile readFileHandle;
-  if (readFileHandle.OpenFile(m_segmentIndexFilePath, ADDON_READ_NO_CACHE))
+    if (it != m_onDiskIndex.cend() && it->m_segmentId == searchValue)
+      return *it;
+  }
+  else if (segmentIndexSearchBy == SegmentIndexSearchBy::TIME_INDEX)
   {
-    readFileHandle.Seek(seekStart);
+    // Upper bound gets the segment after the one we want
+    auto it = std::upper_bound(m_onDiskIndex.cbegin(), m_onDiskIndex.cend(), searchValue,
+                               [](int64_t timeIndex, const SegmentIndexOnDiskEntry& entry) { return timeIndex < entry.m_timeIndexStart; });
 
-    std::string line;
-    bool foundSegmentOnDisk = false;
-    while (readFileHandle.ReadLine(line))
+    if (it != m_onDiskIndex.cbegin())
     {
-      const auto& values = StringUtils::Split(line, ",");
-
-      if (values.size() == 3)
-      {
-        int segmentId = std::atoi(values[0].c_str());
-        int timeIndexStart = std::atoi(values[1].c_str());
-        int timeIndexEnd = std::atoi(values[2].c_str());
-
-        if ((segmentIndexSearchBy == SegmentIndexSearchBy::SEGMENT_ID && searchValue == segmentId) ||
-            (segmentIndexSearchBy == SegmentIndexSearchBy::TIME_INDEX && searchValue >= timeIndexStart && searchValue < timeIndexEnd))
-        {
-          entry.m_segmentId = segmentId;
-          entry.m_timeIndexStart = timeIndexStart;
-          entry.m_timeIndexEnd = timeIndexEnd;
-          break;
-        }
-      }
+      --it;
+      if (searchValue >= it->m_timeIndexStart && searchValue < it->m_timeIndexEnd)
+        return *it;
     }
-
-    readFileHandle.Close();
   }
 
-  return entry;
+  return SegmentIndexOnDiskEntry();
 }
@@ -7,11 +7,16 @@
 
 #pragma once
 
+#include "../utils/CompressionUtils.h"
+#include "../utils/Properties.h"
 #include "IManageDemuxPacket.h"
 #include "TimeshiftSegment.h"
+#include "TimeshiftSegmentLoader.h"
+#include "TimeshiftSegmentWriter.h"
 
+#include <atomic>
 #include <chrono>
-#include <map>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -24,8 +29,15 @@ namespace ffmpegdirect
 struct SegmentIndexOnDiskEntry
 {
   int m_segmentId = -1;
-  int m_timeIndexStart = -1;
-  int m_timeIndexEnd = -1;
+  int64_t m_timeIndexStart = -1; // milliseconds
+  int64_t m_timeIndexEnd = -1;
+  int64_t m_byteSize = 0;
+};
+
+struct SegmentIndexInMemoryEntry
+{
+  int64_t m_timeIndexStart; // milliseconds
+  std::shared_ptr<TimeshiftSegment> m_segment;
 };
 
 enum class SegmentIndexSearchBy
@@ -34,16 +46,69 @@ enum class SegmentIndexSearchBy
   TIME_INDEX
 };
 
+/*
+ * A reader's position in the buffer. A buffer shared by several streams has a cursor for
+ * each of them. Only the thread reading through a cursor, which also seeks and
+ * changes its speed, uses it, other threads only see the atomics it publishes.
+ */
+struct TimeshiftReadCursor
+{
+  TimeshiftReadCursor(IManageDemuxPacket* demuxPacketManager) : m_demuxPacketManager(demuxPacketManager) {}
+
+  // Packets are allocated through the stream doing the reading
+  IManageDemuxPacket* m_demuxPacketManager;
+
+  std::shared_ptr<TimeshiftSegment> m_readSegment;
+  TimeshiftSegmentReadPosition m_readPosition;
+
+  // Published for the ingest thread and other readers, the segment ID only changes under the buffer's lock
+  std::atomic<int> m_readSegmentId = {-1};
+  std::atomic<int64_t> m_currentDemuxTimeIndex = {0};
+  std::atomic<bool> m_paused = {false};
+
+  // Trick play steps from the start time index at the speed, a speed of 0 is normal playback
+  int m_trickPlaySpeed = 0;
+  int64_t m_trickPlayStartTimeIndex = 0;
+  std::chrono::steady_clock::time_point m_trickPlayStartTime;
+  std::chrono::steady_clock::time_point m_lastTrickPlayFrameTime;
+  double m_lastTrickPlayPts = STREAM_NOPTS_VALUE;
+};
+
 class TimeshiftBuffer
 {
 public:
-  TimeshiftBuffer(IManageDemuxPacket* demuxPacketManager);
+  TimeshiftBuffer(const Properties& props);
   ~TimeshiftBuffer();
 
-  void AddPacket(DEMUX_PACKET* packet);
-  DEMUX_PACKET* ReadPacket();
-  bool Seek(double timeMs);
-  void SetPaused(bool paused);
+  void AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe);
+
+  /*
+   * A reader starts at the beginning of the segment being written, which is the
+   * latest point that can be decoded from. Readers can only be added once started.
+   */
+  std::shared_ptr<TimeshiftReadCursor> AddReader(IManageDemuxPacket* demuxPacketManager);
+  void RemoveReader(const std::shared_ptr<TimeshiftReadCursor>& cursor);
+
+  /*
+   * The video keyframe flag isn't part of a demux packet, it can optionally be returned
+   * for readers which need it, e.g. when remuxing.
+   */
+  DEMUX_PACKET* ReadPacket(TimeshiftReadCursor& cursor, bool* videoKeyframe = nullptr);
+  bool Seek(TimeshiftReadCursor& cursor, double timeMs);
+  void SetPaused(TimeshiftReadCursor& cursor, bool paused);
+
+  /*
+   * Any speed other than normal or paused starts trick play, where only video keyframes
+   * are read, stepping through the buffer at the speed in either direction. ReadPacket()
+   * returns an empty packet while no keyframe is due. Normal playback continues from the
+   * last keyframe read.
+   */
+  void SetSpeed(TimeshiftReadCursor& cursor, int speed);
+
+  bool IsTrickPlay(const TimeshiftReadCursor& cursor) { return cursor.m_trickPlaySpeed != 0; }
+
+  // At most one keyframe is read per interval during trick play
+  static const int TRICK_PLAY_FRAME_INTERVAL_MS = 200;
 
   bool Start(const std::string& streamId);
 
@@ -63,39 +128,64 @@ public:
 
   int64_t GetEarliestSegmentMillisecondsSinceStart()
   {
-    return m_minOnDiskSeekTimeIndex * 1000;
+    return m_memoryOnly ? m_minInMemorySeekTimeIndex : m_minOnDiskSeekTimeIndex;
   }
 
-  bool HasPacketAvailable()
+  // Time index of the last packet added, on the same timeline as the packets
+  int64_t GetLastPacketTimeIndex() { return m_lastPacketTimeIndex; }
+
+  // Set by the stream doing the ingest, once stopped no more packets will be added
+  void SetIngestRunning(bool running) { m_ingestRunning = running; }
+  bool IsIngestRunning() { return m_ingestRunning; }
+
+  // True when ReadPacket() has something to do, either a packet to read or a
+  // completed read segment to move on from. Segments publish their packets so no lock is needed.
+  bool HasPacketAvailable(const TimeshiftReadCursor& cursor)
   {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    return m_readSegment && m_readSegment->HasPacketAvailable();
+    return cursor.m_readSegment && (cursor.m_readSegment->HasPacketAvailable(cursor.m_readPosition) ||
+                                    cursor.m_readSegment->ReadAllPackets(cursor.m_readPosition));
   }
 
-protected:
-  IManageDemuxPacket* m_demuxPacketManager;
-
 private:
   static const int TIMESHIFT_SEGMENT_LENGTH_SECS = 12;
-  static const int SEGMENT_INDEX_FILE_LINE_LENGTH = 30;
-  static const int TIMESHIFT_SEGMENT_IN_MEMORY_INDEXED_LENGTH_SECS = 60 * 12; // 12 minutes
-  static const int MAX_IN_MEMORY_SEGMENT_INDEXES = TIMESHIFT_SEGMENT_IN_MEMORY_INDEXED_LENGTH_SECS / TIMESHIFT_SEGMENT_LENGTH_SECS + 1;
+  static const int64_t TIMESHIFT_SEGMENT_LENGTH_MS = TIMESHIFT_SEGMENT_LENGTH_SECS * 1000;
+  static const int64_t TIMESHIFT_SEGMENT_MAX_LENGTH_MS = TIMESHIFT_SEGMENT_LENGTH_MS * 2;
   static constexpr float DEFAULT_TIMESHIFT_SEGMENT_ON_DISK_LENGTH_HOURS = 1.0f;
+  static const int DEFAULT_READ_AHEAD_SEGMENTS = 2;
+  static const int DEFAULT_MEMORY_BUFFER_SIZE_MB = 256;
+  static const int MIN_MEMORY_ONLY_SEGMENTS = 2;
 
   void RemoveOldestInMemoryAndOnDiskSegments();
-  SegmentIndexOnDiskEntry SearchOnDiskIndex(const SegmentIndexSearchBy& segmentIndexSearchBy, int searchValue);
-
-  int m_lastPacketSecondsSinceStart = 0;
-  int m_lastSegmentSecondsSinceStart = 0;
-  int m_minInMemorySeekTimeIndex = 0;
-  int m_segmentInMemoryIndexOffset = 0;
-  int m_minOnDiskSeekTimeIndex = 0;
+  void RemoveOldestInMemorySegment();
+  void RemoveSegmentsOverMemoryBudget();
+  std::shared_ptr<TimeshiftSegment> CreateWriteSegment();
+  void AddToOnDiskIndex(const SegmentIndexOnDiskEntry& entry);
+  void RequestReadAhead(TimeshiftReadCursor& cursor);
+  void MoveToNextSegment(TimeshiftReadCursor& cursor);
+  bool SeekToTimeIndex(TimeshiftReadCursor& cursor, int64_t seekMs, bool readAhead);
+  DEMUX_PACKET* ReadTrickPlayPacket(TimeshiftReadCursor& cursor);
+  bool IsReadByOtherCursor(const TimeshiftReadCursor& cursor, int segmentId);
+  SegmentIndexOnDiskEntry SearchOnDiskIndex(const SegmentIndexSearchBy& segmentIndexSearchBy, int64_t searchValue);
+
+  // All time indexes are in milliseconds, the last packet's is also read by exports
+  std::atomic<int64_t> m_lastPacketTimeIndex = {0};
+  int64_t m_lastSegmentTimeIndex = 0;
+  int64_t m_minInMemorySeekTimeIndex = 0;
+  int64_t m_minOnDiskSeekTimeIndex = 0;
+
+  TimeshiftSegmentWriter m_segmentWriter;
+  int m_readAheadSegments = DEFAULT_READ_AHEAD_SEGMENTS;
+  TimeshiftSegmentFileOptions m_segmentFileOptions;
+  // Shared by all readers, only started when reading ahead
+  TimeshiftSegmentLoader m_segmentLoader;
 
   std::shared_ptr<TimeshiftSegment> m_firstSegment;
-  std::shared_ptr<TimeshiftSegment> m_readSegment;
   std::shared_ptr<TimeshiftSegment> m_writeSegment;
 
-  std::map<int, std::shared_ptr<TimeshiftSegment>> m_segmentTimeIndexMap;
+  std::vector<std::shared_ptr<TimeshiftReadCursor>> m_cursors;
+
+  // In memory segments sorted by start time, oldest first
+  std::vector<SegmentIndexInMemoryEntry> m_inMemoryIndex;
   int m_currentSegmentIndex = 0;
   int m_earliestOnDiskSegmentId = 0;
   int m_segmentTotalCount = 0;
@@ -106,19 +196,28 @@ private:
   std::string m_streamId;
 
   bool m_readingInitialPackets = true;
+  std::atomic<bool> m_hasVideoKeyframes = {false};
+  std::atomic<bool> m_ingestRunning = {false};
 
-  kodi::vfs::CFile m_segmentIndexFileHandle;
+  // Timeline of completed segments still on disk, sorted by both segment ID and time
+  std::deque<SegmentIndexOnDiskEntry> m_onDiskIndex;
+  std::unique_ptr<TimeshiftFile> m_segmentIndexFileHandle;
 
   std::string m_timeshiftBufferPath;
   std::string m_segmentIndexFilePath;
 
   std::mutex m_mutex;
 
-  int m_currentDemuxTimeIndex;
-  bool m_paused = false;
-
   bool m_enableOnDiskSegmentLimit = false;
   int m_maxOnDiskSegments;
+
+  // Files of removed segments waiting to be reused for new segments, the pool is sized by the on disk limit
+  std::deque<std::string> m_recycledSegmentFiles;
+  int m_segmentFilePoolSize = 0;
+
+  // Segments are kept in memory within a byte budget, in memory only mode the filesystem is never used
+  bool m_memoryOnly = false;
+  size_t m_memoryBufferBudget = 0;
 };
 
 } //namespace ffmpegdirect
@@ -0,0 +1,410 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftExporter.h"
+
+#include "TimeshiftFile.h"
+#include "url/URL.h"
+#include "../utils/Log.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <kodi/Filesystem.h>
+#include <kodi/tools/StringUtils.h>
+
+using namespace ffmpegdirect;
+using namespace kodi::tools;
+
+namespace
+{
+
+// Writes are large so the throughput is bound by the storage
+const int EXPORT_IO_BUFFER_SIZE = 1024 * 1024;
+
+// Waiting at the live edge for the end time, the ingest is polled at this interval
+const int EXPORT_LIVE_EDGE_POLL_MS = 100;
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int WriteExportFile(void* opaque, const uint8_t* buffer, int bufferSize)
+#else
+int WriteExportFile(void* opaque, uint8_t* buffer, int bufferSize)
+#endif
+{
+  TimeshiftFile* file = static_cast<TimeshiftFile*>(opaque);
+
+  const ssize_t written = file->Write(buffer, bufferSize);
+  if (written != bufferSize)
+    return AVERROR(EIO);
+
+  return bufferSize;
+}
+
+int64_t SeekExportFile(void* opaque, int64_t offset, int whence)
+{
+  TimeshiftFile* file = static_cast<TimeshiftFile*>(opaque);
+
+  switch (whence & ~AVSEEK_FORCE)
+  {
+    case AVSEEK_SIZE:
+      return file->GetLength();
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += file->GetPosition();
+      break;
+    case SEEK_END:
+      offset += file->GetLength();
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+
+  return file->Seek(offset);
+}
+
+} // unnamed namespace
+
+TimeshiftExporter& TimeshiftExporter::GetInstance()
+{
+  static TimeshiftExporter exporter;
+  return exporter;
+}
+
+TimeshiftExporter::~TimeshiftExporter()
+{
+  Stop();
+}
+
+TimeshiftExporter::ExportTask::~ExportTask()
+{
+  if (m_cursor)
+    m_timeshiftBuffer->RemoveReader(m_cursor);
+
+  for (auto& codecParameters : m_codecParameters)
+    avcodec_parameters_free(&codecParameters.second);
+}
+
+void TimeshiftExporter::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running = false;
+    m_abortExport = true;
+  }
+  m_queueCondition.notify_all();
+
+  if (m_exportThread.joinable())
+    m_exportThread.join();
+}
+
+bool TimeshiftExporter::QueueExport(const std::shared_ptr<TimeshiftBuffer>& timeshiftBuffer,
+                                    std::map<int, AVCodecParameters*>&& codecParameters,
+                                    int64_t startTimeMs, int64_t endTimeMs, const std::string& exportFile)
+{
+  std::unique_ptr<ExportTask> task(new ExportTask());
+  task->m_timeshiftBuffer = timeshiftBuffer;
+  task->m_codecParameters = std::move(codecParameters);
+  task->m_endTimeMs = endTimeMs;
+  task->m_exportFile = exportFile;
+
+  if (!GetFormatName(exportFile))
+  {
+    Log(LOGLEVEL_ERROR, "%s - Timeshift export file must be .ts, .m2ts or .mkv: %s", __FUNCTION__, CURL::GetRedacted(exportFile).c_str());
+    return false;
+  }
+
+  if (task->m_codecParameters.empty())
+  {
+    Log(LOGLEVEL_ERROR, "%s - No streams to export to: %s", __FUNCTION__, CURL::GetRedacted(exportFile).c_str());
+    return false;
+  }
+
+  // The reader is positioned now, not when the export starts, so the range can't be
+  // removed from the buffer while the export is queued
+  task->m_cursor = timeshiftBuffer->AddReader(this);
+  if (!timeshiftBuffer->Seek(*task->m_cursor, static_cast<double>(startTimeMs)))
+  {
+    Log(LOGLEVEL_ERROR, "%s - Start time ms: %lld is no longer in the timeshift buffer", __FUNCTION__, static_cast<long long>(startTimeMs));
+    return false;
+  }
+
+  Log(LOGLEVEL_INFO, "%s - Queued timeshift export from ms: %lld to ms: %lld to: %s", __FUNCTION__,
+      static_cast<long long>(startTimeMs), static_cast<long long>(endTimeMs), CURL::GetRedacted(exportFile).c_str());
+
+  std::thread stoppedThread;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.emplace_back(std::move(task));
+
+    if (!m_running)
+    {
+      // A thread from before Stop() has already finished, it only needs joining
+      stoppedThread = std::move(m_exportThread);
+
+      m_running = true;
+      m_abortExport = false;
+      m_exportThread = std::thread([&] { Process(); });
+    }
+  }
+  m_queueCondition.notify_one();
+
+  if (stoppedThread.joinable())
+    stoppedThread.join();
+
+  return true;
+}
+
+void TimeshiftExporter::Process()
+{
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift exporter: started", __FUNCTION__);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    m_queueCondition.wait(lock, [&] { return !m_running || !m_queue.empty(); });
+
+    if (!m_running)
+    {
+      if (!m_queue.empty())
+        Log(LOGLEVEL_WARNING, "%s - Dropping %d queued timeshift exports", __FUNCTION__, static_cast<int>(m_queue.size()));
+      m_queue.clear();
+      break;
+    }
+
+    std::unique_ptr<ExportTask> task = std::move(m_queue.front());
+    m_queue.pop_front();
+    lock.unlock();
+
+    if (!Export(*task) && !kodi::vfs::DeleteFile(task->m_exportFile))
+      Log(LOGLEVEL_DEBUG, "%s - Failed to delete incomplete export file: %s", __FUNCTION__, CURL::GetRedacted(task->m_exportFile).c_str());
+
+    // Releasing the task can release the buffer, do it before taking the lock again
+    task.reset();
+
+    lock.lock();
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift exporter: stopped", __FUNCTION__);
+}
+
+bool TimeshiftExporter::Export(ExportTask& task)
+{
+  const auto startTime = std::chrono::steady_clock::now();
+  const std::string redactedExportFile = CURL::GetRedacted(task.m_exportFile);
+
+  std::unique_ptr<TimeshiftFile> file = TimeshiftFile::Create(task.m_exportFile);
+  if (!file->OpenFileForWrite(task.m_exportFile))
+  {
+    Log(LOGLEVEL_ERROR, "%s - Failed to open export file: %s", __FUNCTION__, redactedExportFile.c_str());
+    return false;
+  }
+
+  AVFormatContext* outputContext = nullptr;
+  if (avformat_alloc_output_context2(&outputContext, nullptr, GetFormatName(task.m_exportFile), nullptr) < 0 || !outputContext)
+  {
+    Log(LOGLEVEL_ERROR, "%s - Failed to create %s muxer", __FUNCTION__, GetFormatName(task.m_exportFile));
+    return false;
+  }
+
+  uint8_t* ioBuffer = static_cast<uint8_t*>(av_malloc(EXPORT_IO_BUFFER_SIZE));
+  AVIOContext* ioContext = ioBuffer ? avio_alloc_context(ioBuffer, EXPORT_IO_BUFFER_SIZE, 1, file.get(), nullptr, WriteExportFile, SeekExportFile) : nullptr;
+  if (!ioContext)
+  {
+    av_free(ioBuffer);
+    avformat_free_context(outputContext);
+    return false;
+  }
+  outputContext->pb = ioContext;
+  outputContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  // Streams the muxer can't take, e.g. teletext in matroska, are left out
+  std::map<int, AVStream*> outputStreams;
+  for (const auto& codecParameters : task.m_codecParameters)
+  {
+    if (avformat_query_codec(outputContext->oformat, codecParameters.second->codec_id, FF_COMPLIANCE_NORMAL) == 0)
+    {
+      Log(LOGLEVEL_DEBUG, "%s - Stream ID: %d can't be exported with the %s muxer", __FUNCTION__, codecParameters.first, outputContext->oformat->name);
+      continue;
+    }
+
+    AVStream* outputStream = avformat_new_stream(outputContext, nullptr);
+    if (!outputStream || avcodec_parameters_copy(outputStream->codecpar, codecParameters.second) < 0)
+      continue;
+
+    // The tag is specific to the container the stream was demuxed from
+    outputStream->codecpar->codec_tag = 0;
+    outputStream->time_base = {1, STREAM_TIME_BASE};
+    outputStreams[codecParameters.first] = outputStream;
+  }
+
+  bool exported = !outputStreams.empty() && avformat_write_header(outputContext, nullptr) >= 0;
+  if (!exported)
+    Log(LOGLEVEL_ERROR, "%s - Failed to write header of export file: %s", __FUNCTION__, redactedExportFile.c_str());
+
+  const AVRational packetTimeBase = {1, STREAM_TIME_BASE};
+  double timestampOffset = STREAM_NOPTS_VALUE;
+  int64_t packetCount = 0;
+  m_encryptedPacketCount = 0;
+
+  int64_t lastTimeIndex = -1;
+  bool reachedEndTime = false;
+
+  AVPacket* avPacket = av_packet_alloc();
+  while (exported && avPacket && !m_abortExport)
+  {
+    // Checked before looking for a packet so one added just before the ingest stopped isn't missed
+    const bool ingestRunning = task.m_timeshiftBuffer->IsIngestRunning();
+    if (!task.m_timeshiftBuffer->HasPacketAvailable(*task.m_cursor))
+    {
+      // An end time past the live edge is waited for until the ingest stops, after which
+      // everything up to the last packet added has been exported
+      if (!ingestRunning)
+      {
+        reachedEndTime = task.m_endTimeMs <= task.m_timeshiftBuffer->GetLastPacketTimeIndex();
+        break;
+      }
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_queueCondition.wait_for(lock, std::chrono::milliseconds(EXPORT_LIVE_EDGE_POLL_MS), [&] { return !m_running; });
+      continue;
+    }
+
+    bool videoKeyframe = false;
+    DEMUX_PACKET* packet = task.m_timeshiftBuffer->ReadPacket(*task.m_cursor, &videoKeyframe);
+    if (!packet)
+      continue;
+
+    const double timestamp = packet->dts != STREAM_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (timestamp != STREAM_NOPTS_VALUE)
+    {
+      const int64_t timeIndex = PtsToTimeIndexMs(timestamp);
+      if (timeIndex > task.m_endTimeMs)
+      {
+        reachedEndTime = true;
+        FreeDemuxPacketFromInputStreamAPI(packet);
+        break;
+      }
+      lastTimeIndex = timeIndex;
+    }
+
+    // Timestamps start from zero in the export, packets before the first timestamp are left out
+    if (timestampOffset == STREAM_NOPTS_VALUE)
+      timestampOffset = timestamp;
+
+    auto outputStream = outputStreams.find(packet->iStreamId);
+    if (outputStream == outputStreams.end() || packet->iSize <= 0 || timestampOffset == STREAM_NOPTS_VALUE)
+    {
+      FreeDemuxPacketFromInputStreamAPI(packet);
+      continue;
+    }
+
+    // The payload was allocated by us with padding, so it's handed over without a copy
+    if (av_packet_from_data(avPacket, packet->pData, packet->iSize) < 0)
+    {
+      FreeDemuxPacketFromInputStreamAPI(packet);
+      continue;
+    }
+    packet->pData = nullptr;
+
+    const AVPacketSideData* sideData = static_cast<const AVPacketSideData*>(packet->pSideData);
+    for (int i = 0; i < packet->iSideDataElems; i++)
+    {
+      uint8_t* newSideData = av_packet_new_side_data(avPacket, sideData[i].type, sideData[i].size);
+      if (newSideData)
+        memcpy(newSideData, sideData[i].data, sideData[i].size);
+    }
+
+    avPacket->stream_index = outputStream->second->index;
+    avPacket->pts = packet->pts != STREAM_NOPTS_VALUE ? static_cast<int64_t>(packet->pts - timestampOffset) : AV_NOPTS_VALUE;
+    avPacket->dts = packet->dts != STREAM_NOPTS_VALUE ? static_cast<int64_t>(packet->dts - timestampOffset) : AV_NOPTS_VALUE;
+    avPacket->duration = static_cast<int64_t>(packet->duration);
+    if (videoKeyframe || outputStream->second->codecpar->codec_type != AVMEDIA_TYPE_VIDEO)
+      avPacket->flags |= AV_PKT_FLAG_KEY;
+    av_packet_rescale_ts(avPacket, packetTimeBase, outputStream->second->time_base);
+
+    FreeDemuxPacketFromInputStreamAPI(packet);
+
+    // Takes the packet's reference, leaving it blank for the next one
+    if (av_interleaved_write_frame(outputContext, avPacket) < 0)
+    {
+      Log(LOGLEVEL_ERROR, "%s - Failed to write packet to export file: %s", __FUNCTION__, redactedExportFile.c_str());
+      exported = false;
+      break;
+    }
+    packetCount++;
+  }
+  av_packet_free(&avPacket);
+
+  // An aborted export still gets a trailer, so what was written so far can be played
+  if (exported && av_write_trailer(outputContext) < 0)
+    exported = false;
+
+  avio_flush(ioContext);
+  const bool ioError = ioContext->error < 0;
+  av_freep(&ioContext->buffer);
+  avio_context_free(&ioContext);
+  avformat_free_context(outputContext);
+
+  const int64_t fileSize = file->GetLength();
+  file->Close();
+
+  if (!exported || ioError)
+  {
+    Log(LOGLEVEL_ERROR, "%s - Timeshift export failed: %s", __FUNCTION__, redactedExportFile.c_str());
+    return false;
+  }
+
+  if (m_encryptedPacketCount > 0)
+    Log(LOGLEVEL_WARNING, "%s - Skipped %d encrypted packets which can't be exported", __FUNCTION__, m_encryptedPacketCount);
+
+  const char* result = "completed";
+  if (m_abortExport)
+  {
+    result = "aborted";
+  }
+  else if (!reachedEndTime)
+  {
+    result = "cut short";
+    Log(LOGLEVEL_WARNING, "%s - The timeshift ingest stopped before the end time, export ends at ms: %lld instead of ms: %lld",
+        __FUNCTION__, static_cast<long long>(lastTimeIndex), static_cast<long long>(task.m_endTimeMs));
+  }
+
+  const double exportSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  const double fileSizeMB = static_cast<double>(fileSize) / (1024 * 1024);
+  Log(LOGLEVEL_INFO, "%s - Timeshift export %s: %s, packets: %lld, size: %.1f MB, time: %.1f secs, throughput: %.1f MB/s",
+      __FUNCTION__, result, redactedExportFile.c_str(), static_cast<long long>(packetCount),
+      fileSizeMB, exportSecs, exportSecs > 0 ? fileSizeMB / exportSecs : 0.0);
+
+  return true;
+}
+
+const char* TimeshiftExporter::GetFormatName(const std::string& exportFile)
+{
+  const size_t extensionPos = exportFile.rfind('.');
+  if (extensionPos == std::string::npos)
+    return nullptr;
+
+  std::string extension = exportFile.substr(extensionPos);
+  StringUtils::ToLower(extension);
+
+  if (extension == ".ts" || extension == ".m2ts")
+    return "mpegts";
+  else if (extension == ".mkv")
+    return "matroska";
+
+  return nullptr;
+}
+
+DEMUX_PACKET* TimeshiftExporter::AllocateEncryptedDemuxPacketFromInputStreamAPI(int dataSize, unsigned int encryptedSubsampleCount)
+{
+  // Without the keys encrypted packets are of no use in an export
+  m_encryptedPacketCount++;
+  return nullptr;
+}
@@ -0,0 +1,96 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "DemuxPacketAllocator.h"
+#include "TimeshiftBuffer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace ffmpegdirect
+{
+
+/*
+ * Exports a time range of a timeshift buffer to a MPEG-TS or Matroska file, e.g. to keep
+ * something which is being watched. The packets already in the buffer, in memory or on
+ * disk, are remuxed as they are, so nothing is downloaded again or decoded.
+ *
+ * There is a single exporter for all streams, exports are done one at a time on a
+ * dedicated thread. Each export holds its own reader on the buffer, which keeps the
+ * range from being removed and keeps the buffer itself alive after the stream which
+ * queued the export has been closed. Encrypted packets can't be exported and are skipped.
+ */
+class TimeshiftExporter : public DemuxPacketAllocator
+{
+public:
+  static TimeshiftExporter& GetInstance();
+  ~TimeshiftExporter();
+
+  /*
+   * Stops the thread. An export in progress is cut short but the file written so far
+   * is still finalised, queued exports are dropped.
+   */
+  void Stop();
+
+  /*
+   * The times are the buffer's packet time indexes in milliseconds, the format is chosen
+   * by the extension of the export file: .ts, .m2ts or .mkv. Takes ownership of the codec
+   * parameters, which are by stream ID. An end time past the live edge is waited for
+   * until the ingest stops. Returns false if the export can't be queued.
+   */
+  bool QueueExport(const std::shared_ptr<TimeshiftBuffer>& timeshiftBuffer,
+                   std::map<int, AVCodecParameters*>&& codecParameters,
+                   int64_t startTimeMs, int64_t endTimeMs, const std::string& exportFile);
+
+  DEMUX_PACKET* AllocateEncryptedDemuxPacketFromInputStreamAPI(int dataSize, unsigned int encryptedSubsampleCount) override;
+
+private:
+  struct ExportTask
+  {
+    ~ExportTask();
+
+    std::shared_ptr<TimeshiftBuffer> m_timeshiftBuffer;
+    std::shared_ptr<TimeshiftReadCursor> m_cursor;
+    std::map<int, AVCodecParameters*> m_codecParameters;
+    int64_t m_endTimeMs;
+    std::string m_exportFile;
+  };
+
+  TimeshiftExporter() = default;
+
+  void Process();
+  bool Export(ExportTask& task);
+  static const char* GetFormatName(const std::string& exportFile);
+
+  std::deque<std::unique_ptr<ExportTask>> m_queue;
+
+  bool m_running = false;
+  std::atomic<bool> m_abortExport = {false};
+  std::thread m_exportThread;
+  std::condition_variable m_queueCondition;
+  std::mutex m_mutex;
+
+  // Only used by the export thread
+  int m_encryptedPacketCount = 0;
+};
+
+} //namespace ffmpegdirect
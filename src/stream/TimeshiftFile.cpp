@@ -0,0 +1,188 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftFile.h"
+
+#include "../utils/DiskUtils.h"
+
+#if defined(TARGET_POSIX)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace ffmpegdirect;
+
+std::unique_ptr<TimeshiftFile> TimeshiftFile::Create(const std::string& path, bool allowNative)
+{
+#if defined(TARGET_POSIX)
+  std::string localPath;
+  if (allowNative && DiskUtils::GetLocalPath(path, localPath))
+    return std::unique_ptr<TimeshiftFile>(new PosixTimeshiftFile());
+#endif
+
+  return std::unique_ptr<TimeshiftFile>(new VfsTimeshiftFile());
+}
+
+bool VfsTimeshiftFile::OpenFile(const std::string& path)
+{
+  return m_file.OpenFile(path, ADDON_READ_NO_CACHE);
+}
+
+bool VfsTimeshiftFile::OpenFileForWrite(const std::string& path)
+{
+  // We need to pass the overwrite parameter as true as otherwise
+  // opening on SMB for write on android will fail.
+  return m_file.OpenFileForWrite(path, true);
+}
+
+ssize_t VfsTimeshiftFile::ReadAt(void* data, size_t size, int64_t position)
+{
+  const int64_t currentPosition = m_file.GetPosition();
+
+  if (m_file.Seek(position) != position)
+    return -1;
+  ssize_t bytesRead = m_file.Read(data, size);
+  m_file.Seek(currentPosition);
+
+  return bytesRead;
+}
+
+ssize_t VfsTimeshiftFile::WriteAt(const void* data, size_t size, int64_t position)
+{
+  const int64_t currentPosition = m_file.GetPosition();
+
+  m_file.Seek(position);
+  ssize_t written = m_file.Write(data, size);
+  m_file.Seek(currentPosition);
+
+  return written;
+}
+
+#if defined(TARGET_POSIX)
+PosixTimeshiftFile::~PosixTimeshiftFile()
+{
+  Close();
+}
+
+bool PosixTimeshiftFile::Open(const std::string& path, int flags)
+{
+  Close();
+
+  std::string localPath;
+  if (!DiskUtils::GetLocalPath(path, localPath))
+    return false;
+
+  m_fd = open(localPath.c_str(), flags | O_CLOEXEC, 0644);
+  return m_fd >= 0;
+}
+
+bool PosixTimeshiftFile::OpenFile(const std::string& path)
+{
+  return Open(path, O_RDONLY);
+}
+
+bool PosixTimeshiftFile::OpenFileForWrite(const std::string& path)
+{
+  return Open(path, O_RDWR | O_CREAT | O_TRUNC);
+}
+
+void PosixTimeshiftFile::Close()
+{
+  if (m_fd >= 0)
+  {
+    close(m_fd);
+    m_fd = -1;
+  }
+}
+
+ssize_t PosixTimeshiftFile::Read(void* data, size_t size)
+{
+  // Short reads only happen at the end of the file or when interrupted, so keep going
+  size_t totalRead = 0;
+  while (totalRead < size)
+  {
+    ssize_t bytesRead = read(m_fd, static_cast<uint8_t*>(data) + totalRead, size - totalRead);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0)
+      return totalRead > 0 ? totalRead : bytesRead;
+    totalRead += bytesRead;
+  }
+
+  return totalRead;
+}
+
+ssize_t PosixTimeshiftFile::ReadAt(void* data, size_t size, int64_t position)
+{
+  // A single call per read instead of a seek and a read, and the file position is left alone
+  size_t totalRead = 0;
+  while (totalRead < size)
+  {
+    ssize_t bytesRead = pread(m_fd, static_cast<uint8_t*>(data) + totalRead, size - totalRead, position + totalRead);
+    if (bytesRead < 0 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0)
+      return totalRead > 0 ? totalRead : bytesRead;
+    totalRead += bytesRead;
+  }
+
+  return totalRead;
+}
+
+ssize_t PosixTimeshiftFile::Write(const void* data, size_t size)
+{
+  size_t totalWritten = 0;
+  while (totalWritten < size)
+  {
+    ssize_t written = write(m_fd, static_cast<const uint8_t*>(data) + totalWritten, size - totalWritten);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return totalWritten > 0 ? totalWritten : written;
+    totalWritten += written;
+  }
+
+  return totalWritten;
+}
+
+ssize_t PosixTimeshiftFile::WriteAt(const void* data, size_t size, int64_t position)
+{
+  size_t totalWritten = 0;
+  while (totalWritten < size)
+  {
+    ssize_t written = pwrite(m_fd, static_cast<const uint8_t*>(data) + totalWritten, size - totalWritten, position + totalWritten);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return totalWritten > 0 ? totalWritten : written;
+    totalWritten += written;
+  }
+
+  return totalWritten;
+}
+
+int64_t PosixTimeshiftFile::Seek(int64_t position)
+{
+  return lseek(m_fd, position, SEEK_SET);
+}
+
+int64_t PosixTimeshiftFile::GetPosition() const
+{
+  return lseek(m_fd, 0, SEEK_CUR);
+}
+
+int64_t PosixTimeshiftFile::GetLength() const
+{
+  struct stat fileStat;
+  if (fstat(m_fd, &fileStat) != 0)
+    return -1;
+
+  return fileStat.st_size;
+}
+#endif
@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <kodi/Filesystem.h>
+
+namespace ffmpegdirect
+{
+
+/*
+ * Storage backend for timeshift segment and index files.
+ *
+ * Files on a local filesystem are accessed natively, avoiding a call across the addon
+ * boundary for every read and write. Anything else, e.g. smb:// or nfs:// paths, goes
+ * through kodi's VFS. Paths are always given in kodi's form, special:// included.
+ */
+class TimeshiftFile
+{
+public:
+  /*
+   * Create a file for the path using the native backend if the path is local and
+   * native access is allowed, otherwise using kodi's VFS.
+   */
+  static std::unique_ptr<TimeshiftFile> Create(const std::string& path, bool allowNative = true);
+
+  virtual ~TimeshiftFile() = default;
+
+  virtual const char* GetBackendName() const = 0;
+
+  // Opens for reading, bypassing any cache
+  virtual bool OpenFile(const std::string& path) = 0;
+  // Opens for writing, an existing file is overwritten
+  virtual bool OpenFileForWrite(const std::string& path) = 0;
+  virtual bool IsOpen() const = 0;
+  virtual void Close() = 0;
+
+  virtual ssize_t Read(void* data, size_t size) = 0;
+  // Reads from a position without moving the current position
+  virtual ssize_t ReadAt(void* data, size_t size, int64_t position) = 0;
+  virtual ssize_t Write(const void* data, size_t size) = 0;
+  // Writes at a position without moving the current position
+  virtual ssize_t WriteAt(const void* data, size_t size, int64_t position) = 0;
+  virtual int64_t Seek(int64_t position) = 0;
+  virtual int64_t GetPosition() const = 0;
+  virtual int64_t GetLength() const = 0;
+};
+
+class VfsTimeshiftFile : public TimeshiftFile
+{
+public:
+  const char* GetBackendName() const override { return "vfs"; }
+
+  bool OpenFile(const std::string& path) override;
+  bool OpenFileForWrite(const std::string& path) override;
+  bool IsOpen() const override { return m_file.IsOpen(); }
+  void Close() override { m_file.Close(); }
+
+  ssize_t Read(void* data, size_t size) override { return m_file.Read(data, size); }
+  ssize_t ReadAt(void* data, size_t size, int64_t position) override;
+  ssize_t Write(const void* data, size_t size) override { return m_file.Write(data, size); }
+  ssize_t WriteAt(const void* data, size_t size, int64_t position) override;
+  int64_t Seek(int64_t position) override { return m_file.Seek(position); }
+  int64_t GetPosition() const override { return m_file.GetPosition(); }
+  int64_t GetLength() const override { return m_file.GetLength(); }
+
+private:
+  kodi::vfs::CFile m_file;
+};
+
+#if defined(TARGET_POSIX)
+class PosixTimeshiftFile : public TimeshiftFile
+{
+public:
+  ~PosixTimeshiftFile() override;
+
+  const char* GetBackendName() const override { return "posix"; }
+
+  bool OpenFile(const std::string& path) override;
+  bool OpenFileForWrite(const std::string& path) override;
+  bool IsOpen() const override { return m_fd >= 0; }
+  void Close() override;
+
+  ssize_t Read(void* data, size_t size) override;
+  ssize_t ReadAt(void* data, size_t size, int64_t position) override;
+  ssize_t Write(const void* data, size_t size) override;
+  ssize_t WriteAt(const void* data, size_t size, int64_t position) override;
+  int64_t Seek(int64_t position) override;
+  int64_t GetPosition() const override;
+  int64_t GetLength() const override;
+
+private:
+  bool Open(const std::string& path, int flags);
+
+  int m_fd = -1;
+};
+#endif
+
+} //namespace ffmpegdirect
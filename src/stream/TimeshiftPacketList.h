@@ -0,0 +1,112 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+#include <kodi/addon-instance/Inputstream.h>
+
+namespace ffmpegdirect
+{
+
+/*
+ * Packets are held in their serialized segment file form, either in the segment's
+ * arena or in the memory mapped segment file. A null record means the packet has
+ * not been loaded from disk yet.
+ */
+struct TimeshiftPacket
+{
+  const uint8_t* m_record = nullptr;
+  uint32_t m_recordSize = 0;
+  double m_pts = STREAM_NOPTS_VALUE;
+  bool m_keyframe = false;
+};
+
+/*
+ * An append only list of packets that a single writer can add to while readers
+ * read the packets added so far without taking a lock.
+ *
+ * Packets are stored in fixed size chunks from a fixed size table so a packet never
+ * moves once added. A packet is written before the size is published with release
+ * semantics, a reader loading the size with acquire semantics therefore only ever
+ * sees complete packets. Resizing and clearing are not safe while another thread
+ * reads the list.
+ */
+class TimeshiftPacketList
+{
+public:
+  static const size_t CHUNK_SIZE = 512;
+  static const size_t MAX_CHUNKS = 512;
+  static const size_t MAX_PACKETS = CHUNK_SIZE * MAX_CHUNKS;
+
+  size_t size() const { return m_size.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+  bool IsFull() const { return size() == MAX_PACKETS; }
+
+  TimeshiftPacket& operator[](size_t index) { return m_chunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+  const TimeshiftPacket& operator[](size_t index) const { return m_chunks[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+
+  bool emplace_back(const TimeshiftPacket& packet)
+  {
+    const size_t index = m_size.load(std::memory_order_relaxed);
+    if (index == MAX_PACKETS || !AllocateChunk(index / CHUNK_SIZE))
+      return false;
+
+    m_chunks[index / CHUNK_SIZE][index % CHUNK_SIZE] = packet;
+    m_size.store(index + 1, std::memory_order_release);
+    return true;
+  }
+
+  void resize(size_t size)
+  {
+    if (size > MAX_PACKETS)
+      size = MAX_PACKETS;
+
+    for (size_t chunk = 0; chunk * CHUNK_SIZE < size; chunk++)
+      AllocateChunk(chunk);
+
+    m_size.store(size, std::memory_order_release);
+  }
+
+  void clear()
+  {
+    m_size.store(0, std::memory_order_release);
+    for (auto& chunk : m_chunks)
+      chunk.reset();
+    m_chunkCount.store(0, std::memory_order_relaxed);
+  }
+
+  // Can be called from any thread
+  size_t GetMemorySize() const
+  {
+    return sizeof(m_chunks) + m_chunkCount.load(std::memory_order_relaxed) * CHUNK_SIZE * sizeof(TimeshiftPacket);
+  }
+
+private:
+  bool AllocateChunk(size_t chunk)
+  {
+    if (!m_chunks[chunk])
+    {
+      m_chunks[chunk].reset(new (std::nothrow) TimeshiftPacket[CHUNK_SIZE]);
+      if (m_chunks[chunk])
+        m_chunkCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return m_chunks[chunk] != nullptr;
+  }
+
+  std::array<std::unique_ptr<TimeshiftPacket[]>, MAX_CHUNKS> m_chunks;
+  std::atomic<size_t> m_size = {0};
+  std::atomic<size_t> m_chunkCount = {0};
+};
+
+} //namespace ffmpegdirect
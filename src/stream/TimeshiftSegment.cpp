@@ -7,6 +7,7 @@
 
 #include "TimeshiftSegment.h"
 
+#include "TimeshiftSegmentFormat.h"
 #include "url/URL.h"
 #include "../utils/DiskUtils.h"
 #include "../utils/Log.h"
@@ -16,30 +17,56 @@ extern "C"
 #include <libavcodec/avcodec.h>
 }
 
+#include <algorithm>
+#include <cstddef>
+
 #include <kodi/tools/StringUtils.h>
 
 using namespace ffmpegdirect;
 using namespace kodi::tools;
 
-TimeshiftSegment::TimeshiftSegment(IManageDemuxPacket* demuxPacketManager, const std::string& streamId, int segmentId, const std::string& timeshiftBufferPath)
-  : m_demuxPacketManager(demuxPacketManager), m_streamId(streamId), m_segmentId(segmentId)
+TimeshiftSegment::TimeshiftSegment(TimeshiftSegmentWriter* segmentWriter, const std::string& streamId, int segmentId, const std::string& timeshiftBufferPath,
+                                   const TimeshiftSegmentFileOptions& fileOptions, bool recycledFile, int64_t preallocateSize)
+  : m_segmentId(segmentId), m_streamId(streamId), m_segmentWriter(segmentWriter),
+    m_compression(fileOptions.m_compression), m_limitPageCache(fileOptions.m_limitPageCache)
 {
   m_segmentFilename = StringUtils::Format("%s-%08d.seg", streamId.c_str(), segmentId);
   Log(LOGLEVEL_DEBUG, "%s - Segment ID: %d, Segment Filename: %s", __FUNCTION__, segmentId, CURL::GetRedacted(m_segmentFilename).c_str());
 
   m_timeshiftSegmentFilePath = timeshiftBufferPath + "/" + m_segmentFilename;
+  m_fileHandle = TimeshiftFile::Create(m_timeshiftSegmentFilePath, fileOptions.m_nativeStorage);
+
+  // Completed segments on a local filesystem are read through a memory mapping
+  std::string localBufferPath;
+  if (DiskUtils::GetLocalPath(timeshiftBufferPath, localBufferPath))
+    m_localSegmentFilePath = localBufferPath + "/" + m_segmentFilename;
 
-  // Only open the file for writing if it doesn't exist
+  // Only open the file for writing if it doesn't exist or is a recycled file
   // If it does exist then this segment is being created to
   // to load an out of memory segment for a seek operation
-  if (!kodi::vfs::FileExists(m_timeshiftSegmentFilePath))
+  if (recycledFile || !kodi::vfs::FileExists(m_timeshiftSegmentFilePath))
   {
-    // We need to pass the overwrite parameter as true as otherwise
-    // opening on SMB for write on android will fail.
-    if (m_fileHandle.OpenFileForWrite(m_timeshiftSegmentFilePath, true))
+    if (m_fileHandle->OpenFileForWrite(m_timeshiftSegmentFilePath))
     {
-      int32_t packetCountPlaceholder = 0;
-      m_fileHandle.Write(&packetCountPlaceholder, sizeof(packetCountPlaceholder));
+      if (preallocateSize > 0 && !m_localSegmentFilePath.empty())
+        DiskUtils::PreallocateFile(m_localSegmentFilePath, preallocateSize);
+
+      m_writeBuffer.reserve(WRITE_BLOCK_SIZE);
+
+      // The packet count and footer offset are filled in once the segment is complete
+      SegmentFileHeader header = CreateFileHeader();
+      if (m_compression == CompressionMethod::NONE)
+      {
+        WriteToBuffer(&header, sizeof(header));
+      }
+      else
+      {
+        // The header is never compressed, the compressed blocks start after it
+        std::vector<uint8_t> headerData(sizeof(header));
+        memcpy(headerData.data(), &header, sizeof(header));
+        m_lastWriteTicket = m_segmentWriter->QueueWrite(m_fileHandle.get(), std::move(headerData));
+        m_writeOffset += sizeof(header);
+      }
     }
     else
     {
@@ -53,100 +80,76 @@ TimeshiftSegment::TimeshiftSegment(IManageDemuxPacket* demuxPacketManager, const
   }
 }
 
-TimeshiftSegment::~TimeshiftSegment()
+TimeshiftSegment::TimeshiftSegment(const std::string& streamId, int segmentId)
+  : m_segmentId(segmentId), m_streamId(streamId)
 {
-  m_fileHandle.Close();
-
-  for (auto& demuxPacket : m_packetBuffer)
-  {
-    delete[] demuxPacket->pData;
-    if (demuxPacket->cryptoInfo)
-    {
-      delete[] demuxPacket->cryptoInfo->clearBytes;
-      delete[] demuxPacket->cryptoInfo->cipherBytes;
-      delete demuxPacket->cryptoInfo;
-    }
-    FreeSideData(demuxPacket);
-  }
+  m_persistSegments = false;
+  // Never opened, but saves checking for a file everywhere
+  m_fileHandle = TimeshiftFile::Create(std::string(), false);
+  Log(LOGLEVEL_DEBUG, "%s - Segment ID: %d, in memory only", __FUNCTION__, segmentId);
 }
 
-void TimeshiftSegment::AddPacket(DEMUX_PACKET* packet)
+TimeshiftSegment::~TimeshiftSegment()
 {
-  std::shared_ptr<DEMUX_PACKET> newPacket = std::make_shared<DEMUX_PACKET>();
-
-  CopyPacket(packet, newPacket.get(), true);
-
-  m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(packet);
+  // The writer thread may still reference the file handle
+  if (m_lastWriteTicket > 0)
+    m_segmentWriter->WaitForWrite(m_lastWriteTicket);
+  m_fileHandle->Close();
+
+  // Anything still cached once the segment was complete has been written back by now
+  m_mappedFile.Unmap();
+  if (m_limitPageCache && m_persisted && !m_localSegmentFilePath.empty())
+    DiskUtils::AdviseFileAccess(m_localSegmentFilePath, FileAccessAdvice::DONT_NEED);
+}
 
-  std::lock_guard<std::mutex> lock(m_mutex);
+void TimeshiftSegment::AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe)
+{
+  // Only the ingest thread adds packets and writes the segment file, so
+  // apart from the indexes used by seeks nothing here needs the lock
+  TimeshiftPacket newPacket;
+  StorePacket(packet, m_currentPacketIndex, videoKeyframe, newPacket);
 
   //Checksum
   if (m_persistSegments)
   {
-    m_fileHandle.Write(&m_currentPacketIndex, sizeof(m_currentPacketIndex));
-    WritePacket(newPacket);
+    SegmentFooterEntry footerEntry;
+    footerEntry.m_packetIndex = m_currentPacketIndex;
+    footerEntry.m_offset = m_writeOffset;
+    footerEntry.m_pts = newPacket.m_pts;
+    footerEntry.m_keyframe = newPacket.m_keyframe ? 1 : 0;
+    m_footerEntries.emplace_back(footerEntry);
+
+    // The stored packet is already in the on disk format
+    WriteToBuffer(newPacket.m_record, newPacket.m_recordSize);
+
+    if (m_writeBuffer.size() >= WRITE_BLOCK_SIZE)
+      QueueWriteBuffer();
   }
 
-  m_packetBuffer.emplace_back(newPacket);
-
-  int secondsSinceStart = 0;
-  if (newPacket->pts != STREAM_NOPTS_VALUE && newPacket->pts > 0)
-    secondsSinceStart = newPacket->pts / STREAM_TIME_BASE;
-
-  if (secondsSinceStart != m_lastPacketSecondsSinceStart)
   {
-    m_packetTimeIndexMap[secondsSinceStart] = m_currentPacketIndex;
-    m_lastPacketSecondsSinceStart = secondsSinceStart;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    UpdateTimeIndex(m_currentPacketIndex, newPacket.m_pts, newPacket.m_keyframe);
   }
 
+  // Publishes the packet to the reader
+  if (!m_packets.emplace_back(newPacket))
+    Log(LOGLEVEL_ERROR, "%s - Failed to add packet %d to segment ID: %d", __FUNCTION__, m_currentPacketIndex, m_segmentId);
+
   m_currentPacketIndex++;
 }
 
-void TimeshiftSegment::CopyPacket(DEMUX_PACKET* sourcePacket, DEMUX_PACKET* newPacket, bool allocateData)
+void TimeshiftSegment::UpdateTimeIndex(int packetIndex, double pts, bool keyframe)
 {
-  // Note that this is not needed if allocating in kodi
-  if (allocateData)
-    newPacket->pData = new uint8_t[sourcePacket->iSize];
-
-  newPacket->iSize = sourcePacket->iSize;
-  if (newPacket->iSize)
-    memcpy(newPacket->pData, sourcePacket->pData, newPacket->iSize);
-  newPacket->iStreamId = sourcePacket->iStreamId;
-  newPacket->demuxerId = sourcePacket->demuxerId;
-  newPacket->iGroupId = sourcePacket->iGroupId;
-
-  CopySideData(sourcePacket, newPacket);
-
-  newPacket->pts = sourcePacket->pts;
-  newPacket->dts = sourcePacket->dts;
-  newPacket->duration = sourcePacket->duration;
-  newPacket->dispTime = sourcePacket->dispTime;
-  newPacket->recoveryPoint = sourcePacket->recoveryPoint;
-  newPacket->cryptoInfo = sourcePacket->cryptoInfo;
-
-  if (sourcePacket->cryptoInfo)
-  {
-    if (allocateData)
-    {
-      newPacket->cryptoInfo = new DEMUX_CRYPTO_INFO();
-      newPacket->cryptoInfo->clearBytes = new uint16_t[sourcePacket->cryptoInfo->numSubSamples];
-      newPacket->cryptoInfo->cipherBytes = new uint32_t[sourcePacket->cryptoInfo->numSubSamples];
-    }
-    newPacket->cryptoInfo->numSubSamples = sourcePacket->cryptoInfo->numSubSamples;
-    newPacket->cryptoInfo->flags = sourcePacket->cryptoInfo->flags;
-
-    memcpy(newPacket->cryptoInfo->clearBytes, sourcePacket->cryptoInfo->clearBytes, newPacket->cryptoInfo->numSubSamples * sizeof(uint16_t));
-    memcpy(newPacket->cryptoInfo->cipherBytes, sourcePacket->cryptoInfo->cipherBytes, newPacket->cryptoInfo->numSubSamples * sizeof(uint32_t));
-    memcpy(newPacket->cryptoInfo->iv, sourcePacket->cryptoInfo->iv, sizeof(uint8_t) * 16);
-    memcpy(newPacket->cryptoInfo->kid, sourcePacket->cryptoInfo->kid, sizeof(uint8_t) * 16);
-  }
-  else
-  {
-    newPacket->cryptoInfo = nullptr;
-  }
+  // Only a packet later than all before it is indexed, which keeps the index sorted by both time
+  // and packet index. Seeks are then a binary search and land on the first packet at that time.
+  const int64_t timeMs = PtsToTimeIndexMs(pts);
+  if (m_packetTimeIndex.empty() || timeMs > m_packetTimeIndex.back().m_timeMs)
+    m_packetTimeIndex.push_back({timeMs, packetIndex});
+
+  if (keyframe && (m_keyframePacketIndexes.empty() || packetIndex > m_keyframePacketIndexes.back()))
+    m_keyframePacketIndexes.emplace_back(packetIndex);
 }
 
-
 namespace
 {
 
@@ -168,99 +171,136 @@ void FreeAvPacketButNotSideData(AVPacket* avPacket)
   av_free(avPacket);
 }
 
-} // unnamed namespace
-
-void TimeshiftSegment::CopySideData(DEMUX_PACKET* sourcePacket, DEMUX_PACKET* newPacket)
+template<typename T>
+bool ReadFromBuffer(const uint8_t*& data, const uint8_t* dataEnd, T* value, size_t size)
 {
-  newPacket->pSideData = nullptr;
-  newPacket->iSideDataElems = 0;
-  if (sourcePacket->iSideDataElems > 0)
-  {
-    AVPacket* srcAvPacket = AllocateAvPacketButNotSideData();
-    if (srcAvPacket)
-    {
-      srcAvPacket->side_data = static_cast<AVPacketSideData*>(sourcePacket->pSideData);
-      srcAvPacket->side_data_elems = sourcePacket->iSideDataElems;
-
-      AVPacket* newAvPacket = AllocateAvPacketButNotSideData();
-      if (newAvPacket)
-      {
-        av_packet_copy_props(newAvPacket, srcAvPacket);
-        newPacket->pSideData = newAvPacket->side_data;
-        newPacket->iSideDataElems = newAvPacket->side_data_elems;
+  if (static_cast<size_t>(dataEnd - data) < size)
+    return false;
 
-        FreeAvPacketButNotSideData(newAvPacket);
-      }
+  memcpy(value, data, size);
+  data += size;
+  return true;
+}
 
-      FreeAvPacketButNotSideData(srcAvPacket);
-    }
-  }
+void WriteToRecord(uint8_t*& record, const void* data, size_t size)
+{
+  memcpy(record, data, size);
+  record += size;
 }
 
-void TimeshiftSegment::FreeSideData(std::shared_ptr<DEMUX_PACKET>& packet)
+size_t GetRecordSize(const DEMUX_PACKET* packet)
 {
-  if (packet->iSideDataElems > 0)
-  {
-    AVPacket* avPkt = AllocateAvPacketButNotSideData();
-    if (avPkt)
-    {
-      avPkt->side_data = static_cast<AVPacketSideData*>(packet->pSideData);
-      avPkt->side_data_elems = packet->iSideDataElems;
+  size_t recordSize = sizeof(SegmentPacketRecord);
 
-      //! @todo: properly handle avpkt side_data. this works around our inproper use of the side_data
-      // as we pass pointers to ffmpeg allocated memory for the side_data. we should really be allocating
-      // and storing our own AVPacket. This will require some extensive changes.
+  if (packet->iSize > 0)
+    recordSize += packet->iSize;
 
-      // here we make use of ffmpeg to free the side_data, we shouldn't have to allocate an intermediate AVPacket though
-      av_packet_free(&avPkt);
-    }
-  }
+  const AVPacketSideData* sideData = static_cast<const AVPacketSideData*>(packet->pSideData);
+  for (int i = 0; i < packet->iSideDataElems; i++)
+    recordSize += sizeof(SegmentSideDataRecord) + sideData[i].size;
+
+  if (packet->cryptoInfo)
+    recordSize += sizeof(SegmentCryptoRecord) + (sizeof(uint16_t) + sizeof(uint32_t)) * packet->cryptoInfo->numSubSamples;
+
+  return recordSize;
 }
 
-void TimeshiftSegment::WritePacket(std::shared_ptr<DEMUX_PACKET>& packet)
+} // unnamed namespace
+
+SegmentFileHeader TimeshiftSegment::CreateFileHeader()
 {
-  m_fileHandle.Write(&packet->iSize, sizeof(packet->iSize));
-  if (packet->iSize > 0)
-    m_fileHandle.Write(packet->pData, packet->iSize);
+  SegmentFileHeader header;
+  header.m_segmentId = m_segmentId;
+  header.m_compression = static_cast<uint8_t>(m_compression);
+  strncpy(header.m_streamId, m_streamId.c_str(), SEGMENT_FILE_STREAM_ID_LENGTH - 1);
 
-  m_fileHandle.Write(&packet->iStreamId, sizeof(packet->iStreamId));
-  m_fileHandle.Write(&packet->demuxerId, sizeof(packet->demuxerId));
-  m_fileHandle.Write(&packet->iGroupId, sizeof(packet->iGroupId));
+  return header;
+}
+
+void TimeshiftSegment::StorePacket(const DEMUX_PACKET* packet, int32_t packetIndex, bool keyframe, TimeshiftPacket& storedPacket)
+{
+  // Serialize straight into the arena so the packet costs a single
+  // bump allocation and the same bytes can be written to disk as is
+  storedPacket.m_recordSize = static_cast<uint32_t>(GetRecordSize(packet));
+  uint8_t* recordStart = m_arena.Allocate(storedPacket.m_recordSize);
+  uint8_t* record = recordStart;
+
+  SegmentPacketRecord packetRecord;
+  packetRecord.m_packetIndex = packetIndex;
+  packetRecord.m_size = packet->iSize;
+  packetRecord.m_streamId = packet->iStreamId;
+  packetRecord.m_demuxerId = packet->demuxerId;
+  packetRecord.m_groupId = packet->iGroupId;
+  packetRecord.m_pts = packet->pts;
+  packetRecord.m_dts = packet->dts;
+  packetRecord.m_duration = packet->duration;
+  packetRecord.m_dispTime = packet->dispTime;
+  packetRecord.m_recoveryPoint = packet->recoveryPoint ? 1 : 0;
+  packetRecord.m_flags = 0;
+  if (keyframe)
+    packetRecord.m_flags |= SEGMENT_PACKET_FLAG_KEYFRAME;
+  if (packet->cryptoInfo)
+    packetRecord.m_flags |= SEGMENT_PACKET_FLAG_CRYPTO_INFO;
+  packetRecord.m_sideDataElems = static_cast<uint16_t>(packet->iSideDataElems);
+
+  WriteToRecord(record, &packetRecord, sizeof(packetRecord));
 
-  m_fileHandle.Write(&packet->iSideDataElems, sizeof(packet->iSideDataElems));
+  if (packet->iSize > 0)
+    WriteToRecord(record, packet->pData, packet->iSize);
 
   if (packet->iSideDataElems > 0)
   {
-    AVPacketSideData* sideData = static_cast<AVPacketSideData*>(packet->pSideData);
+    const AVPacketSideData* sideData = static_cast<const AVPacketSideData*>(packet->pSideData);
     for (int i = 0; i < packet->iSideDataElems; i++)
     {
-      m_fileHandle.Write(&sideData[i].type, sizeof(sideData[i].type));
-      m_fileHandle.Write(&sideData[i].size, sizeof(sideData[i].size));
+      SegmentSideDataRecord sideDataRecord;
+      sideDataRecord.m_type = static_cast<uint32_t>(sideData[i].type);
+      sideDataRecord.m_size = static_cast<uint32_t>(sideData[i].size);
+      WriteToRecord(record, &sideDataRecord, sizeof(sideDataRecord));
       if (sideData[i].size > 0)
-        m_fileHandle.Write(sideData[i].data, sideData[i].size);
+        WriteToRecord(record, sideData[i].data, sideData[i].size);
     }
   }
 
-  m_fileHandle.Write(&packet->pts, sizeof(packet->pts));
-  m_fileHandle.Write(&packet->dts, sizeof(packet->dts));
-  m_fileHandle.Write(&packet->duration, sizeof(packet->duration));
-  m_fileHandle.Write(&packet->recoveryPoint, sizeof(packet->recoveryPoint));
-
-  bool hasCryptoInfo = packet->cryptoInfo != nullptr;
-  m_fileHandle.Write(&hasCryptoInfo, sizeof(hasCryptoInfo));
-  if (hasCryptoInfo)
+  if (packet->cryptoInfo)
   {
-    int numSubSamples = packet->cryptoInfo->numSubSamples;
-    m_fileHandle.Write(&numSubSamples, sizeof(numSubSamples));
-    m_fileHandle.Write(&packet->cryptoInfo->flags, sizeof(packet->cryptoInfo->flags));
-    if (numSubSamples > 0)
+    SegmentCryptoRecord cryptoRecord;
+    cryptoRecord.m_numSubSamples = packet->cryptoInfo->numSubSamples;
+    cryptoRecord.m_flags = packet->cryptoInfo->flags;
+    memcpy(cryptoRecord.m_iv, packet->cryptoInfo->iv, sizeof(cryptoRecord.m_iv));
+    memcpy(cryptoRecord.m_kid, packet->cryptoInfo->kid, sizeof(cryptoRecord.m_kid));
+    WriteToRecord(record, &cryptoRecord, sizeof(cryptoRecord));
+
+    if (cryptoRecord.m_numSubSamples > 0)
     {
-      m_fileHandle.Write(packet->cryptoInfo->clearBytes, sizeof(uint16_t) * numSubSamples);
-      m_fileHandle.Write(packet->cryptoInfo->cipherBytes, sizeof(uint32_t) * numSubSamples);
+      WriteToRecord(record, packet->cryptoInfo->clearBytes, sizeof(uint16_t) * cryptoRecord.m_numSubSamples);
+      WriteToRecord(record, packet->cryptoInfo->cipherBytes, sizeof(uint32_t) * cryptoRecord.m_numSubSamples);
     }
-    m_fileHandle.Write(packet->cryptoInfo->iv, sizeof(uint8_t) * 16);
-    m_fileHandle.Write(packet->cryptoInfo->kid, sizeof(uint8_t) * 16);
   }
+
+  storedPacket.m_record = recordStart;
+  storedPacket.m_pts = packet->pts;
+  storedPacket.m_keyframe = keyframe;
+}
+
+void TimeshiftSegment::WriteToBuffer(const void* data, size_t size)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  m_writeBuffer.insert(m_writeBuffer.end(), bytes, bytes + size);
+  m_writeOffset += size;
+}
+
+void TimeshiftSegment::QueueWriteBuffer()
+{
+  if (m_writeBuffer.empty())
+    return;
+
+  // Segments are rarely read back from disk, so there's no point in them filling the page cache as they are written
+  m_lastWriteTicket = m_segmentWriter->QueueWrite(m_fileHandle.get(), std::move(m_writeBuffer), -1, m_compression,
+                                                  m_limitPageCache ? m_localSegmentFilePath : std::string());
+
+  m_writeBuffer = std::vector<uint8_t>();
+  m_writeBuffer.reserve(WRITE_BLOCK_SIZE);
 }
 
 void TimeshiftSegment::ForceLoadSegment()
@@ -271,24 +311,25 @@ void TimeshiftSegment::ForceLoadSegment()
 
 void TimeshiftSegment::LoadSegment()
 {
+  // Called for every packet read, so a loaded segment doesn't take the lock
+  if (m_loaded)
+    return;
+
   std::lock_guard<std::mutex> lock(m_mutex);
 
-  if (!m_loaded && m_fileHandle.OpenFile(m_timeshiftSegmentFilePath, ADDON_READ_NO_CACHE))
+  if (!m_loaded && m_fileHandle->OpenFile(m_timeshiftSegmentFilePath))
   {
-    int32_t packetCount = 0;
-    m_fileHandle.Read(&packetCount, sizeof(packetCount));
+    // Files written before the segment header existed start with the packet count
+    int32_t legacyPacketCount = 0;
+    m_fileHandle->Read(&legacyPacketCount, sizeof(legacyPacketCount));
 
-    for (int i = 0; i < packetCount; i++)
-    {
-      std::shared_ptr<DEMUX_PACKET> newPacket = std::make_shared<DEMUX_PACKET>();
-      int loadedPacketIndex = LoadPacket(newPacket);
-      // Checksum does not match
-      if (loadedPacketIndex != i)
-        Log(LOGLEVEL_ERROR, "%s - segment load error, packet index %d does not equal expected value of %d with a total packet count of: %d", __FUNCTION__, loadedPacketIndex, i, m_currentPacketIndex);
-      m_packetBuffer.emplace_back(newPacket);
-    }
+    if (static_cast<uint32_t>(legacyPacketCount) == SEGMENT_FILE_MAGIC)
+      LoadPackets();
+    else
+      LoadLegacyPackets(legacyPacketCount);
 
-    m_currentPacketIndex = packetCount;
+    // Unless mapped or decompressed the file is left open to read packets from as they're needed
+    m_loadPacketsOnDemand = m_fileHandle->IsOpen();
     m_persisted = true;
     m_completed = true;
 
@@ -296,128 +337,510 @@ void TimeshiftSegment::LoadSegment()
   }
 }
 
-int TimeshiftSegment::LoadPacket(std::shared_ptr<DEMUX_PACKET>& packet)
+bool TimeshiftSegment::ReadFileHeader(SegmentFileHeader& header)
 {
-  //Checksum
-  int packetIndex;
-  m_fileHandle.Read(&packetIndex, sizeof(packetIndex));
+  if (m_fileHandle->ReadAt(&header, sizeof(header), 0) != sizeof(header) ||
+      header.m_magic != SEGMENT_FILE_MAGIC)
+  {
+    Log(LOGLEVEL_ERROR, "%s - Invalid header for segment file: %s", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str());
+    return false;
+  }
 
-  m_fileHandle.Read(&packet->iSize, sizeof(packet->iSize));
-  if (packet->iSize > 0)
+  if (header.m_version > SEGMENT_FILE_VERSION || header.m_headerSize < sizeof(SegmentFileHeader))
   {
-    packet->pData = new uint8_t[packet->iSize];
-    m_fileHandle.Read(packet->pData, packet->iSize);
+    Log(LOGLEVEL_ERROR, "%s - Unsupported segment file version %d, header size %d for file: %s", __FUNCTION__, header.m_version, header.m_headerSize, CURL::GetRedacted(m_segmentFilename).c_str());
+    return false;
   }
 
-  m_fileHandle.Read(&packet->iStreamId, sizeof(packet->iStreamId));
-  m_fileHandle.Read(&packet->demuxerId, sizeof(packet->demuxerId));
-  m_fileHandle.Read(&packet->iGroupId, sizeof(packet->iGroupId));
+  if (m_streamId.compare(0, SEGMENT_FILE_STREAM_ID_LENGTH - 1, header.m_streamId) != 0 || header.m_segmentId != m_segmentId)
+    Log(LOGLEVEL_WARNING, "%s - Segment file header stream ID: %s, segment ID: %d does not match expected stream ID: %s, segment ID: %d", __FUNCTION__, header.m_streamId, header.m_segmentId, m_streamId.c_str(), m_segmentId);
 
-  m_fileHandle.Read(&packet->iSideDataElems, sizeof(packet->iSideDataElems));
-  if (packet->iSideDataElems > 0)
+  return true;
+}
+
+bool TimeshiftSegment::ReadFileFooter(const SegmentFileHeader& header)
+{
+  m_footerEntries.clear();
+
+  if (header.m_footerOffset <= 0 || header.m_packetCount <= 0 ||
+      header.m_packetCount > static_cast<int32_t>(TimeshiftPacketList::MAX_PACKETS))
+    return false;
+
+  m_footerEntries.resize(header.m_packetCount);
+  const size_t footerSize = sizeof(SegmentFooterEntry) * header.m_packetCount;
+
+  if (m_fileHandle->ReadAt(m_footerEntries.data(), footerSize, header.m_footerOffset) != static_cast<ssize_t>(footerSize))
   {
-    AVPacket* avPacket = AllocateAvPacketButNotSideData();
-    if (avPacket)
+    Log(LOGLEVEL_ERROR, "%s - Failed to read footer for segment file: %s", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str());
+    m_footerEntries.clear();
+    return false;
+  }
+
+  return true;
+}
+
+namespace
+{
+
+// Returns the size of the serialized packet at data or 0 if it's truncated
+size_t GetSerializedRecordSize(const uint8_t* data, const uint8_t* dataEnd)
+{
+  const uint8_t* recordStart = data;
+
+  SegmentPacketRecord record;
+  if (!ReadFromBuffer(data, dataEnd, &record, sizeof(record)) ||
+      record.m_size < 0 || dataEnd - data < record.m_size)
+    return 0;
+  data += record.m_size;
+
+  for (int i = 0; i < record.m_sideDataElems; i++)
+  {
+    SegmentSideDataRecord sideDataRecord;
+    if (!ReadFromBuffer(data, dataEnd, &sideDataRecord, sizeof(sideDataRecord)) ||
+        static_cast<size_t>(dataEnd - data) < sideDataRecord.m_size)
+      return 0;
+    data += sideDataRecord.m_size;
+  }
+
+  if (record.m_flags & SEGMENT_PACKET_FLAG_CRYPTO_INFO)
+  {
+    SegmentCryptoRecord cryptoRecord;
+    if (!ReadFromBuffer(data, dataEnd, &cryptoRecord, sizeof(cryptoRecord)))
+      return 0;
+
+    const size_t subSampleSize = (sizeof(uint16_t) + sizeof(uint32_t)) * cryptoRecord.m_numSubSamples;
+    if (static_cast<size_t>(dataEnd - data) < subSampleSize)
+      return 0;
+    data += subSampleSize;
+  }
+
+  return data - recordStart;
+}
+
+int32_t GetRecordPacketIndex(const uint8_t* record)
+{
+  int32_t packetIndex;
+  memcpy(&packetIndex, record + offsetof(SegmentPacketRecord, m_packetIndex), sizeof(packetIndex));
+  return packetIndex;
+}
+
+} // unnamed namespace
+
+void TimeshiftSegment::LoadPackets()
+{
+  SegmentFileHeader header;
+  if (!ReadFileHeader(header))
+    return;
+
+  if (header.m_compression != static_cast<uint8_t>(CompressionMethod::NONE))
+  {
+    LoadCompressedPackets(header);
+    return;
+  }
+
+  if (ReadFileFooter(header))
+  {
+    // With a footer nothing but the index needs to be read up front, packets
+    // are loaded on demand from the read position in ReadPacket()
+    IndexPacketsFromFooter(header);
+
+    // If mapped, the packets are read straight from the page cache so
+    // nothing needs to be copied into the arena at all
+    if (!m_localSegmentFilePath.empty() && m_mappedFile.Map(m_localSegmentFilePath))
     {
-      enum AVPacketSideDataType type;
-      size_t size;
-      for (int i = 0; i < packet->iSideDataElems; i++)
+      if (m_mappedFile.GetSize() >= static_cast<size_t>(m_packetDataEndOffset))
       {
-        m_fileHandle.Read(&type, sizeof(type));
-        m_fileHandle.Read(&size, sizeof(size));
-
-        uint8_t* data = av_packet_new_side_data(avPacket, type, size);
-        m_fileHandle.Read(data, size);
+        SetPacketRecords(header, m_mappedFile.GetData(), 0);
+        m_fileHandle->Close();
       }
+      else
+      {
+        m_mappedFile.Unmap();
+      }
+    }
+    return;
+  }
 
-      packet->pSideData = avPacket->side_data;
+  // A segment that was never completed has no footer, so the only option is to read it front to back
+  Log(LOGLEVEL_WARNING, "%s - Segment file has no footer, loading sequentially: %s", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str());
 
-      FreeAvPacketButNotSideData(avPacket);
+  int64_t dataSize = m_fileHandle->GetLength() - header.m_headerSize;
+  if (dataSize <= 0)
+    return;
+
+  uint8_t* data = m_arena.Allocate(dataSize);
+  ssize_t bytesRead = m_fileHandle->ReadAt(data, dataSize, header.m_headerSize);
+
+  ParsePackets(data, data + (bytesRead > 0 ? bytesRead : 0));
+}
+
+void TimeshiftSegment::LoadCompressedPackets(const SegmentFileHeader& header)
+{
+  const CompressionMethod compression = static_cast<CompressionMethod>(header.m_compression);
+
+  int64_t fileDataSize = m_fileHandle->GetLength() - header.m_headerSize;
+  if (fileDataSize <= 0)
+    return;
+
+  std::vector<uint8_t> fileData(fileDataSize);
+  ssize_t bytesRead = m_fileHandle->ReadAt(fileData.data(), fileData.size(), header.m_headerSize);
+  fileData.resize(bytesRead > 0 ? bytesRead : 0);
+
+  // Compressed segments are small enough to always be decompressed in full, so
+  // first find out how large the data is when decompressed
+  size_t dataSize = 0;
+  for (size_t position = 0; position + sizeof(SegmentBlockHeader) <= fileData.size();)
+  {
+    SegmentBlockHeader blockHeader;
+    memcpy(&blockHeader, fileData.data() + position, sizeof(blockHeader));
+    position += sizeof(blockHeader) + blockHeader.m_storedSize;
+    if (position > fileData.size())
+      break;
+    dataSize += blockHeader.m_size;
+  }
+
+  if (dataSize == 0)
+    return;
+
+  uint8_t* data = m_arena.Allocate(dataSize);
+  size_t decompressedSize = 0;
+  for (size_t position = 0; decompressedSize < dataSize;)
+  {
+    SegmentBlockHeader blockHeader;
+    memcpy(&blockHeader, fileData.data() + position, sizeof(blockHeader));
+    position += sizeof(blockHeader);
+
+    const uint8_t* blockData = fileData.data() + position;
+    if (blockHeader.m_storedSize == blockHeader.m_size)
+      memcpy(data + decompressedSize, blockData, blockHeader.m_size);
+    else if (!CompressionUtils::Decompress(compression, blockData, blockHeader.m_storedSize, data + decompressedSize, blockHeader.m_size))
+      break;
+
+    position += blockHeader.m_storedSize;
+    decompressedSize += blockHeader.m_size;
+  }
+
+  if (decompressedSize < dataSize)
+    Log(LOGLEVEL_ERROR, "%s - Failed to decompress segment file: %s, only %lld of %lld bytes decompressed", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str(), static_cast<long long>(decompressedSize), static_cast<long long>(dataSize));
+
+  // Everything is in memory now, the file is not needed any more
+  m_fileHandle->Close();
+
+  // Offsets in the file are before compression, i.e. relative to the start of the file rather than the decompressed data
+  const int64_t footerPosition = header.m_footerOffset - header.m_headerSize;
+  const size_t footerSize = sizeof(SegmentFooterEntry) * header.m_packetCount;
+  if (header.m_footerOffset > 0 && header.m_packetCount > 0 &&
+      footerPosition >= 0 && static_cast<size_t>(footerPosition) + footerSize <= decompressedSize)
+  {
+    m_footerEntries.resize(header.m_packetCount);
+    memcpy(m_footerEntries.data(), data + footerPosition, footerSize);
+
+    IndexPacketsFromFooter(header);
+    SetPacketRecords(header, data, header.m_headerSize);
+    return;
+  }
+
+  Log(LOGLEVEL_WARNING, "%s - Segment file has no footer, loading sequentially: %s", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str());
+
+  ParsePackets(data, data + decompressedSize);
+}
+
+void TimeshiftSegment::IndexPacketsFromFooter(const SegmentFileHeader& header)
+{
+  m_packets.resize(m_footerEntries.size());
+  for (size_t i = 0; i < m_footerEntries.size(); i++)
+  {
+    m_packets[i].m_pts = m_footerEntries[i].m_pts;
+    m_packets[i].m_keyframe = m_footerEntries[i].m_keyframe != 0;
+    UpdateTimeIndex(m_footerEntries[i].m_packetIndex, m_footerEntries[i].m_pts, m_packets[i].m_keyframe);
+  }
+
+  m_packetDataEndOffset = header.m_footerOffset;
+  m_currentPacketIndex = static_cast<int32_t>(m_footerEntries.size());
+}
+
+void TimeshiftSegment::SetPacketRecords(const SegmentFileHeader& header, const uint8_t* data, int64_t dataOffset)
+{
+  // data holds the segment file contents starting from dataOffset
+  for (size_t i = 0; i < m_footerEntries.size(); i++)
+  {
+    const int64_t offset = m_footerEntries[i].m_offset;
+    const int64_t nextOffset = i + 1 < m_footerEntries.size() ? m_footerEntries[i + 1].m_offset : m_packetDataEndOffset;
+    // An invalid offset leaves the packet unloaded and it will be skipped
+    if (offset < header.m_headerSize || nextOffset <= offset || nextOffset > m_packetDataEndOffset)
+      continue;
+
+    m_packets[i].m_record = data + (offset - dataOffset);
+    m_packets[i].m_recordSize = static_cast<uint32_t>(nextOffset - offset);
+  }
+}
+
+void TimeshiftSegment::ParsePackets(const uint8_t* data, const uint8_t* dataEnd)
+{
+  int packetCount = 0;
+  size_t recordSize;
+  while (data < dataEnd && (recordSize = GetSerializedRecordSize(data, dataEnd)) > 0)
+  {
+    int loadedPacketIndex = GetRecordPacketIndex(data);
+
+    // Checksum does not match
+    if (loadedPacketIndex != packetCount)
+      Log(LOGLEVEL_ERROR, "%s - segment load error, packet index %d does not equal expected value of %d", __FUNCTION__, loadedPacketIndex, packetCount);
+
+    TimeshiftPacket newPacket;
+    newPacket.m_record = data;
+    newPacket.m_recordSize = static_cast<uint32_t>(recordSize);
+    memcpy(&newPacket.m_pts, data + offsetof(SegmentPacketRecord, m_pts), sizeof(newPacket.m_pts));
+    newPacket.m_keyframe = (data[offsetof(SegmentPacketRecord, m_flags)] & SEGMENT_PACKET_FLAG_KEYFRAME) != 0;
+
+    UpdateTimeIndex(packetCount, newPacket.m_pts, newPacket.m_keyframe);
+
+    m_packets.emplace_back(newPacket);
+    data += recordSize;
+    packetCount++;
+  }
+
+  m_currentPacketIndex = packetCount;
+}
+
+void TimeshiftSegment::LoadPacketsFrom(int packetIndex)
+{
+  // Read as many packets as fit in a single block from the file so the packet
+  // at the read position is available immediately and the ones after it are
+  // streamed in behind as the reader progresses
+  int lastPacketIndex = packetIndex;
+  const int64_t startOffset = m_footerEntries[packetIndex].m_offset;
+  int64_t endOffset = m_packetDataEndOffset;
+
+  while (++lastPacketIndex < static_cast<int>(m_footerEntries.size()))
+  {
+    if (m_packets[lastPacketIndex].m_record ||
+        m_footerEntries[lastPacketIndex].m_offset - startOffset > LOAD_BLOCK_SIZE)
+    {
+      endOffset = m_footerEntries[lastPacketIndex].m_offset;
+      break;
     }
   }
 
-  m_fileHandle.Read(&packet->pts, sizeof(packet->pts));
-  m_fileHandle.Read(&packet->dts, sizeof(packet->dts));
-  m_fileHandle.Read(&packet->duration, sizeof(packet->duration));
-  m_fileHandle.Read(&packet->recoveryPoint, sizeof(packet->recoveryPoint));
+  if (endOffset <= startOffset)
+  {
+    Log(LOGLEVEL_ERROR, "%s - Invalid offset for packet %d in segment file: %s", __FUNCTION__, packetIndex, CURL::GetRedacted(m_segmentFilename).c_str());
+    return;
+  }
+
+  // The records are read directly into the arena, they are already in the form they are stored in
+  uint8_t* data = m_arena.Allocate(endOffset - startOffset);
+  if (m_fileHandle->ReadAt(data, endOffset - startOffset, startOffset) != static_cast<ssize_t>(endOffset - startOffset))
+  {
+    Log(LOGLEVEL_ERROR, "%s - Failed to read packets %d to %d from segment file: %s", __FUNCTION__, packetIndex, lastPacketIndex - 1, CURL::GetRedacted(m_segmentFilename).c_str());
+    return;
+  }
+
+  for (int i = packetIndex; i < lastPacketIndex; i++)
+  {
+    const int64_t offset = m_footerEntries[i].m_offset;
+    const int64_t nextOffset = i + 1 < lastPacketIndex ? m_footerEntries[i + 1].m_offset : endOffset;
+    if (nextOffset <= offset || nextOffset > endOffset)
+      break;
+
+    const uint8_t* record = data + (offset - startOffset);
+
+    // Checksum does not match
+    int loadedPacketIndex = GetRecordPacketIndex(record);
+    if (loadedPacketIndex != i)
+      Log(LOGLEVEL_ERROR, "%s - segment load error, packet index %d does not equal expected value of %d", __FUNCTION__, loadedPacketIndex, i);
+
+    m_packets[i].m_record = record;
+    m_packets[i].m_recordSize = static_cast<uint32_t>(nextOffset - offset);
+  }
+}
+
+void TimeshiftSegment::LoadLegacyPackets(int32_t packetCount)
+{
+  for (int i = 0; i < packetCount; i++)
+  {
+    TimeshiftPacket newPacket;
+    int loadedPacketIndex = LoadLegacyPacket(newPacket);
+    // Checksum does not match
+    if (loadedPacketIndex != i)
+      Log(LOGLEVEL_ERROR, "%s - segment load error, packet index %d does not equal expected value of %d with a total packet count of: %d", __FUNCTION__, loadedPacketIndex, i, packetCount);
+    UpdateTimeIndex(i, newPacket.m_pts, newPacket.m_keyframe);
+    m_packets.emplace_back(newPacket);
+  }
+
+  m_currentPacketIndex = packetCount;
+}
+
+int TimeshiftSegment::LoadLegacyPacket(TimeshiftPacket& packet)
+{
+  // Legacy packets are read into temporary buffers and then stored in the current format
+  DEMUX_PACKET legacyPacket = {};
+
+  //Checksum
+  int packetIndex;
+  m_fileHandle->Read(&packetIndex, sizeof(packetIndex));
+
+  m_fileHandle->Read(&legacyPacket.iSize, sizeof(legacyPacket.iSize));
+  std::vector<uint8_t> payload(legacyPacket.iSize > 0 ? legacyPacket.iSize : 0);
+  if (legacyPacket.iSize > 0)
+  {
+    m_fileHandle->Read(payload.data(), payload.size());
+    legacyPacket.pData = payload.data();
+  }
+
+  m_fileHandle->Read(&legacyPacket.iStreamId, sizeof(legacyPacket.iStreamId));
+  m_fileHandle->Read(&legacyPacket.demuxerId, sizeof(legacyPacket.demuxerId));
+  m_fileHandle->Read(&legacyPacket.iGroupId, sizeof(legacyPacket.iGroupId));
+
+  m_fileHandle->Read(&legacyPacket.iSideDataElems, sizeof(legacyPacket.iSideDataElems));
+  std::vector<AVPacketSideData> sideData(legacyPacket.iSideDataElems > 0 ? legacyPacket.iSideDataElems : 0);
+  std::vector<std::vector<uint8_t>> sideDataBuffers(sideData.size());
+  for (size_t i = 0; i < sideData.size(); i++)
+  {
+    enum AVPacketSideDataType type;
+    size_t size;
+    m_fileHandle->Read(&type, sizeof(type));
+    m_fileHandle->Read(&size, sizeof(size));
+
+    sideDataBuffers[i].resize(size);
+    m_fileHandle->Read(sideDataBuffers[i].data(), size);
+
+    sideData[i].data = sideDataBuffers[i].data();
+    sideData[i].size = size;
+    sideData[i].type = type;
+  }
+  legacyPacket.pSideData = sideData.data();
+
+  m_fileHandle->Read(&legacyPacket.pts, sizeof(legacyPacket.pts));
+  m_fileHandle->Read(&legacyPacket.dts, sizeof(legacyPacket.dts));
+  m_fileHandle->Read(&legacyPacket.duration, sizeof(legacyPacket.duration));
+  m_fileHandle->Read(&legacyPacket.recoveryPoint, sizeof(legacyPacket.recoveryPoint));
+
+  DEMUX_CRYPTO_INFO cryptoInfo = {};
+  std::vector<uint16_t> clearBytes;
+  std::vector<uint32_t> cipherBytes;
 
   bool hasCryptoInfo;
-  m_fileHandle.Read(&hasCryptoInfo, sizeof(hasCryptoInfo));
+  m_fileHandle->Read(&hasCryptoInfo, sizeof(hasCryptoInfo));
   if (hasCryptoInfo)
   {
     int numSubSamples;
-    m_fileHandle.Read(&numSubSamples, sizeof(numSubSamples));
-
-    packet->cryptoInfo = new DEMUX_CRYPTO_INFO();
+    m_fileHandle->Read(&numSubSamples, sizeof(numSubSamples));
 
-    m_fileHandle.Read(&packet->cryptoInfo->flags, sizeof(packet->cryptoInfo->flags));
+    m_fileHandle->Read(&cryptoInfo.flags, sizeof(cryptoInfo.flags));
     if (numSubSamples > 0)
     {
-      packet->cryptoInfo->clearBytes = new uint16_t[numSubSamples];
-      packet->cryptoInfo->cipherBytes = new uint32_t[numSubSamples];
-      m_fileHandle.Read(packet->cryptoInfo->clearBytes, sizeof(uint16_t) * numSubSamples);
-      m_fileHandle.Read(packet->cryptoInfo->cipherBytes, sizeof(uint32_t) * numSubSamples);
+      cryptoInfo.numSubSamples = static_cast<uint16_t>(numSubSamples);
+      clearBytes.resize(numSubSamples);
+      cipherBytes.resize(numSubSamples);
+      m_fileHandle->Read(clearBytes.data(), sizeof(uint16_t) * numSubSamples);
+      m_fileHandle->Read(cipherBytes.data(), sizeof(uint32_t) * numSubSamples);
+      cryptoInfo.clearBytes = clearBytes.data();
+      cryptoInfo.cipherBytes = cipherBytes.data();
     }
-    m_fileHandle.Read(packet->cryptoInfo->iv, sizeof(uint8_t) * 16);
-    m_fileHandle.Read(packet->cryptoInfo->kid, sizeof(uint8_t) * 16);
+    m_fileHandle->Read(cryptoInfo.iv, sizeof(uint8_t) * 16);
+    m_fileHandle->Read(cryptoInfo.kid, sizeof(uint8_t) * 16);
+
+    legacyPacket.cryptoInfo = &cryptoInfo;
   }
 
+  // Legacy files have no keyframe flag, the recovery point is the closest there is
+  StorePacket(&legacyPacket, packetIndex, legacyPacket.recoveryPoint, packet);
+
   return packetIndex;
 }
 
 int TimeshiftSegment::GetPacketCount()
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-  return m_currentPacketIndex;
+  return static_cast<int>(m_packets.size());
 }
 
-void TimeshiftSegment::MarkAsComplete()
+bool TimeshiftSegment::IsFull()
+{
+  return m_packets.IsFull();
+}
+
+int64_t TimeshiftSegment::GetFileSize()
 {
   std::lock_guard<std::mutex> lock(m_mutex);
+  return m_persistSegments ? m_writeOffset : 0;
+}
 
-  if (m_fileHandle.IsOpen())
+size_t TimeshiftSegment::GetMemorySize()
+{
+  // Readers can be loading packets into the segment, so only sizes which are safe to read from any thread are used
+  return m_arena.GetAllocatedBytes() + m_packets.GetMemorySize();
+}
+
+void TimeshiftSegment::MarkAsComplete()
+{
+  // Only the ingest thread writes the file, so no lock is held while waiting for the write to finish.
+  // Readers see the segment as complete once all of it is persisted.
+  if (m_fileHandle->IsOpen())
   {
-    m_fileHandle.Seek(0);
-    m_fileHandle.Write(&m_currentPacketIndex, sizeof(m_currentPacketIndex));
+    SegmentFileHeader header = CreateFileHeader();
+    header.m_packetCount = m_currentPacketIndex;
+    header.m_footerOffset = m_writeOffset;
+
+    WriteToBuffer(m_footerEntries.data(), sizeof(SegmentFooterEntry) * m_footerEntries.size());
+    QueueWriteBuffer();
+
+    // Rewritten in place and never compressed, compressed blocks only start after the header
+    std::vector<uint8_t> headerData(sizeof(header));
+    memcpy(headerData.data(), &header, sizeof(header));
+    m_lastWriteTicket = m_segmentWriter->QueueWrite(m_fileHandle.get(), std::move(headerData), 0, CompressionMethod::NONE);
+
+    // Wait for the final flush so the file is complete before it's closed
+    m_segmentWriter->WaitForWrite(m_lastWriteTicket);
+    m_lastWriteTicket = 0;
   }
 
-  m_completed = true;
-  m_fileHandle.Close();
+  m_writeBuffer.clear();
+  m_writeBuffer.shrink_to_fit();
+
+  m_fileHandle->Close();
   m_persisted = true;
+  m_completed = true;
+
+  if (m_limitPageCache && !m_localSegmentFilePath.empty())
+    DiskUtils::AdviseFileAccess(m_localSegmentFilePath, FileAccessAdvice::DONT_NEED);
 }
 
 void TimeshiftSegment::ClearPackets()
 {
   std::lock_guard<std::mutex> lock(m_mutex);
 
-  int m_readPacketIndex = 0;
+  // A segment which was never written to disk has nowhere to be reloaded from
+  if (!m_persistSegments)
+    return;
 
-  for (auto& demuxPacket : m_packetBuffer)
-  {
-    delete[] demuxPacket->pData;
-    if (demuxPacket->cryptoInfo)
-    {
-      delete[] demuxPacket->cryptoInfo->clearBytes;
-      delete[] demuxPacket->cryptoInfo->cipherBytes;
-      delete demuxPacket->cryptoInfo;
-    }
-    FreeSideData(demuxPacket);
-  }
-
-  m_packetBuffer.clear();
+  // All packet data lives in the arena or the mapping, so this is all it takes to release it
+  m_packets.clear();
+  m_arena.Clear();
+  m_mappedFile.Unmap();
+  m_loadPacketsOnDemand = false;
   m_loaded = false;
+
+  // The reader has finished with the segment so it's unlikely to be read again soon
+  if (m_limitPageCache && !m_localSegmentFilePath.empty())
+    DiskUtils::AdviseFileAccess(m_localSegmentFilePath, FileAccessAdvice::DONT_NEED);
+
+  // The indexes are rebuilt when the segment is loaded again
+  m_packetTimeIndex.clear();
+  m_packetTimeIndex.shrink_to_fit();
+  m_keyframePacketIndexes.clear();
+  m_keyframePacketIndexes.shrink_to_fit();
 }
 
-bool TimeshiftSegment::ReadAllPackets()
+bool TimeshiftSegment::ReadAllPackets(const TimeshiftSegmentReadPosition& position)
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-  return m_completed && m_readPacketIndex == m_packetBuffer.size();
+  // Completion is only set once the last packet has been published
+  return m_completed && position.m_packetIndex == static_cast<int>(m_packets.size());
 }
 
-bool TimeshiftSegment::HasPacketAvailable()
+bool TimeshiftSegment::HasPacketAvailable(const TimeshiftSegmentReadPosition& position)
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
-  return m_readPacketIndex != m_packetBuffer.size();
+  return position.m_packetIndex != static_cast<int>(m_packets.size());
 }
 
 void TimeshiftSegment::SetNextSegment(std::shared_ptr<TimeshiftSegment> nextSegment)
@@ -432,120 +855,196 @@ std::shared_ptr<TimeshiftSegment> TimeshiftSegment::GetNextSegment()
   return m_nextSegment;
 }
 
-void TimeshiftSegment::ResetReadIndex()
-{
-  std::lock_guard<std::mutex> lock(m_mutex);
-  m_readPacketIndex = 0;
-}
-
-int TimeshiftSegment::GetReadIndex()
-{
-  std::lock_guard<std::mutex> lock(m_mutex);
-  return m_readPacketIndex;
-}
-
 int TimeshiftSegment::GetSegmentId()
 {
-  std::lock_guard<std::mutex> lock(m_mutex);
   return m_segmentId;
 }
 
-DEMUX_PACKET* TimeshiftSegment::ReadPacket()
+DEMUX_PACKET* TimeshiftSegment::ReadPacket(IManageDemuxPacket* demuxPacketManager, TimeshiftSegmentReadPosition& position, bool* videoKeyframe)
 {
   DEMUX_PACKET* packet = nullptr;
 
-  std::lock_guard<std::mutex> lock(m_mutex);
+  if (videoKeyframe)
+    *videoKeyframe = false;
 
-  if (m_packetBuffer.size() != 0 && m_readPacketIndex != m_packetBuffer.size())
+  // No lock is taken so readers never wait on the ingest thread. A segment is loaded under
+  // the lock before it's read and only cleared once no cursor is reading it.
+  const int packetCount = static_cast<int>(m_packets.size());
+  if (packetCount != 0 && position.m_packetIndex != packetCount)
   {
-    std::shared_ptr<DEMUX_PACKET>& nextPacket = m_packetBuffer[m_readPacketIndex++];
+    // Cursors can share a segment which loads its packets on demand, so each block is loaded
+    // under the lock. Mapped and compressed segments are already fully available.
+    if (m_loadPacketsOnDemand && position.m_packetIndex >= position.m_loadedPacketIndexEnd)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_packets[position.m_packetIndex].m_record)
+        LoadPacketsFrom(position.m_packetIndex);
 
-    packet = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(nextPacket->iSize);
+      position.m_loadedPacketIndexEnd = position.m_packetIndex;
+      while (position.m_loadedPacketIndexEnd < packetCount && m_packets[position.m_loadedPacketIndexEnd].m_record)
+        position.m_loadedPacketIndexEnd++;
+    }
 
-    CopyPacket(nextPacket.get(), packet, false);
+    const TimeshiftPacket& nextPacket = m_packets[position.m_packetIndex++];
+    if (videoKeyframe)
+      *videoKeyframe = nextPacket.m_keyframe;
+
+    // An unreadable packet is skipped rather than stalling the reader
+    if (nextPacket.m_record)
+      packet = CreateDemuxPacket(demuxPacketManager, nextPacket);
+
+    // Tell the player the keyframe a seek started from can be decoded without what came before
+    if (packet && position.m_packetIndex - 1 == position.m_recoveryPointPacketIndex)
+      packet->recoveryPoint = true;
+    position.m_recoveryPointPacketIndex = -1;
+
+    if (!packet)
+      packet = demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
   }
   else
   {
-    packet = m_demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
+    packet = demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(0);
   }
 
   return packet;
 }
 
-bool TimeshiftSegment::Seek(double timeMs)
+DEMUX_PACKET* TimeshiftSegment::CreateDemuxPacket(IManageDemuxPacket* demuxPacketManager, const TimeshiftPacket& storedPacket)
 {
-  int seekSeconds = timeMs / 1000;
-  std::lock_guard<std::mutex> lock(m_mutex);
+  const uint8_t* data = storedPacket.m_record;
+  const uint8_t* dataEnd = data + storedPacket.m_recordSize;
 
-  auto seekPacketIndex = m_packetTimeIndexMap.upper_bound(seekSeconds);
-  // Upper bound gets the packet after the one we want
-  if (seekPacketIndex != m_packetTimeIndexMap.begin())
-    --seekPacketIndex;
-
-  if (seekPacketIndex != m_packetTimeIndexMap.end())
+  SegmentPacketRecord record;
+  if (!ReadFromBuffer(data, dataEnd, &record, sizeof(record)) ||
+      record.m_size < 0 || dataEnd - data < record.m_size)
   {
-    m_readPacketIndex = seekPacketIndex->second;
+    Log(LOGLEVEL_ERROR, "%s - Invalid packet in segment: %s", __FUNCTION__, CURL::GetRedacted(m_segmentFilename).c_str());
+    return nullptr;
+  }
 
-    auto it = m_packetTimeIndexMap.begin();
-    int timeIndexStart = it->first;
-    auto it2 = m_packetTimeIndexMap.rbegin();
-    int timeIndexEnd = it2->first;
-    Log(LOGLEVEL_DEBUG, "%s - Seek segment packet - segment ID: %d, packet index: %d, seek seconds: %d, segment start seconds: %d, segment end seconds: %d", __FUNCTION__, m_segmentId, m_readPacketIndex, seekSeconds, timeIndexStart, timeIndexEnd);
+  const uint8_t* payload = data;
+  data += record.m_size;
 
-    return true;
+  // Side data and crypto info follow the payload, we need the subsample count
+  // before allocating so walk the side data first
+  const uint8_t* sideData = data;
+  for (int i = 0; i < record.m_sideDataElems; i++)
+  {
+    SegmentSideDataRecord sideDataRecord;
+    if (!ReadFromBuffer(data, dataEnd, &sideDataRecord, sizeof(sideDataRecord)) || static_cast<size_t>(dataEnd - data) < sideDataRecord.m_size)
+    {
+      record.m_sideDataElems = i;
+      break;
+    }
+    data += sideDataRecord.m_size;
   }
 
-  return false;
-}
+  SegmentCryptoRecord cryptoRecord;
+  const bool hasCryptoInfo = (record.m_flags & SEGMENT_PACKET_FLAG_CRYPTO_INFO) &&
+                             ReadFromBuffer(data, dataEnd, &cryptoRecord, sizeof(cryptoRecord)) &&
+                             static_cast<size_t>(dataEnd - data) >= (sizeof(uint16_t) + sizeof(uint32_t)) * cryptoRecord.m_numSubSamples;
 
-/* For reference */
+  DEMUX_PACKET* packet = nullptr;
+  if (hasCryptoInfo)
+    packet = demuxPacketManager->AllocateEncryptedDemuxPacketFromInputStreamAPI(record.m_size, cryptoRecord.m_numSubSamples);
+  else
+    packet = demuxPacketManager->AllocateDemuxPacketFromInputStreamAPI(record.m_size);
+
+  if (!packet)
+    return nullptr;
+
+  packet->iSize = record.m_size;
+  if (record.m_size > 0)
+    memcpy(packet->pData, payload, record.m_size);
+
+  packet->iStreamId = record.m_streamId;
+  packet->demuxerId = record.m_demuxerId;
+  packet->iGroupId = record.m_groupId;
+  packet->pts = record.m_pts;
+  packet->dts = record.m_dts;
+  packet->duration = record.m_duration;
+  packet->dispTime = record.m_dispTime;
+  packet->recoveryPoint = record.m_recoveryPoint != 0;
+
+  packet->pSideData = nullptr;
+  packet->iSideDataElems = 0;
+  if (record.m_sideDataElems > 0)
+  {
+    AVPacket* avPacket = AllocateAvPacketButNotSideData();
+    if (avPacket)
+    {
+      for (int i = 0; i < record.m_sideDataElems; i++)
+      {
+        SegmentSideDataRecord sideDataRecord;
+        ReadFromBuffer(sideData, dataEnd, &sideDataRecord, sizeof(sideDataRecord));
 
-// typedef struct DEMUX_PACKET
-// {
-//   uint8_t* pData;
-//   int iSize;
-//   int iStreamId;
-//   int64_t demuxerId;
-//   int iGroupId;
+        uint8_t* newSideData = av_packet_new_side_data(avPacket, static_cast<enum AVPacketSideDataType>(sideDataRecord.m_type), sideDataRecord.m_size);
+        if (newSideData)
+          memcpy(newSideData, sideData, sideDataRecord.m_size);
+        sideData += sideDataRecord.m_size;
+      }
 
-//   void* pSideData;
-//   int iSideDataElems;
+      packet->pSideData = avPacket->side_data;
+      packet->iSideDataElems = avPacket->side_data_elems;
 
-//   double pts;
-//   double dts;
-//   double duration;
-//   int dispTime;
-//   bool recoveryPoint;
+      FreeAvPacketButNotSideData(avPacket);
+    }
+  }
 
-//   struct DEMUX_CRYPTO_INFO* cryptoInfo;
+  if (hasCryptoInfo && packet->cryptoInfo)
+  {
+    packet->cryptoInfo->numSubSamples = cryptoRecord.m_numSubSamples;
+    packet->cryptoInfo->flags = cryptoRecord.m_flags;
+    memcpy(packet->cryptoInfo->iv, cryptoRecord.m_iv, sizeof(cryptoRecord.m_iv));
+    memcpy(packet->cryptoInfo->kid, cryptoRecord.m_kid, sizeof(cryptoRecord.m_kid));
+    memcpy(packet->cryptoInfo->clearBytes, data, sizeof(uint16_t) * cryptoRecord.m_numSubSamples);
+    data += sizeof(uint16_t) * cryptoRecord.m_numSubSamples;
+    memcpy(packet->cryptoInfo->cipherBytes, data, sizeof(uint32_t) * cryptoRecord.m_numSubSamples);
+  }
 
-//   KODI_HANDLE backendPacket;
-// } DEMUX_PACKET;
+  return packet;
+}
+
+bool TimeshiftSegment::Seek(double timeMs, TimeshiftSegmentReadPosition& position)
+{
+  const int64_t seekMs = static_cast<int64_t>(timeMs);
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // Upper bound gets the packet after the one we want
+  auto seekPacketIndex = std::upper_bound(m_packetTimeIndex.cbegin(), m_packetTimeIndex.cend(), seekMs,
+                                          [](int64_t time, const PacketTimeIndex& entry) { return time < entry.m_timeMs; });
+  if (seekPacketIndex != m_packetTimeIndex.cbegin())
+    --seekPacketIndex;
 
-// typedef struct AVPacketSideData {
-//     uint8_t *data;
-//     int      size;
-//     enum AVPacketSideDataType type;
-// } AVPacketSideData;
+  if (seekPacketIndex != m_packetTimeIndex.cend())
+  {
+    position.m_packetIndex = seekPacketIndex->m_packetIndex;
+    position.m_loadedPacketIndexEnd = 0;
+
+    // Start from the nearest video keyframe at or before the seek position so the first
+    // packets read can be decoded instead of being discarded by the player
+    position.m_recoveryPointPacketIndex = -1;
+    auto keyframePacketIndex = std::upper_bound(m_keyframePacketIndexes.cbegin(), m_keyframePacketIndexes.cend(), position.m_packetIndex);
+    if (keyframePacketIndex != m_keyframePacketIndexes.cbegin())
+    {
+      --keyframePacketIndex;
+      position.m_packetIndex = *keyframePacketIndex;
+      position.m_recoveryPointPacketIndex = position.m_packetIndex;
+    }
 
-  // explicit DemuxCryptoInfo(const unsigned int numSubs)
-  //   : numSubSamples(numSubs)
-  //   , flags(0)
-  //   , clearBytes(new uint16_t[numSubs])
-  //   , cipherBytes(new uint32_t[numSubs])
-  // {};
+    Log(LOGLEVEL_DEBUG, "%s - Seek segment packet - segment ID: %d, packet index: %d, seek ms: %lld, segment start ms: %lld, segment end ms: %lld", __FUNCTION__, m_segmentId, position.m_packetIndex,
+        static_cast<long long>(seekMs), static_cast<long long>(m_packetTimeIndex.front().m_timeMs), static_cast<long long>(m_packetTimeIndex.back().m_timeMs));
 
-  // ~DemuxCryptoInfo()
-  // {
-  //   delete[] clearBytes;
-  //   delete[] cipherBytes;
-  // }
+    return true;
+  }
 
-  // uint16_t numSubSamples; //number of subsamples
-  // uint16_t flags; //flags for later use
+  return false;
+}
 
-  // uint16_t *clearBytes; // numSubSamples uint16_t's wich define the size of clear size of a subsample
-  // uint32_t *cipherBytes; // numSubSamples uint32_t's wich define the size of cipher size of a subsample
+double TimeshiftSegment::GetPacketPts(const TimeshiftSegmentReadPosition& position)
+{
+  if (position.m_packetIndex < 0 || position.m_packetIndex >= static_cast<int>(m_packets.size()))
+    return STREAM_NOPTS_VALUE;
 
-  // uint8_t iv[16]; // initialization vector
-  // uint8_t kid[16]; // key id
+  return m_packets[position.m_packetIndex].m_pts;
+}
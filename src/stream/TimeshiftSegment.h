@@ -7,10 +7,17 @@
 
 #pragma once
 
+#include "../utils/CompressionUtils.h"
+#include "../utils/MemoryArena.h"
+#include "../utils/MemoryMappedFile.h"
 #include "IManageDemuxPacket.h"
+#include "TimeshiftFile.h"
+#include "TimeshiftPacketList.h"
+#include "TimeshiftSegmentFormat.h"
+#include "TimeshiftSegmentWriter.h"
 
+#include <atomic>
 #include <chrono>
-#include <map>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -24,51 +31,118 @@ namespace ffmpegdirect
 
 static const std::string DEFAULT_TIMESHIFT_BUFFER_PATH = "special://userdata/addon_data/inputstream.ffmpegdirect/timeshift";
 
+struct PacketTimeIndex
+{
+  int64_t m_timeMs;
+  int m_packetIndex;
+};
+
+/*
+ * Timeshift time indexes are the pts in milliseconds, packets without a pts are at time 0
+ */
+inline int64_t PtsToTimeIndexMs(double pts)
+{
+  if (pts == STREAM_NOPTS_VALUE || pts <= 0)
+    return 0;
+
+  return static_cast<int64_t>(pts * 1000 / STREAM_TIME_BASE);
+}
+
+/*
+ * How the files of on disk segments are written and cached
+ */
+struct TimeshiftSegmentFileOptions
+{
+  CompressionMethod m_compression = CompressionMethod::NONE;
+  bool m_limitPageCache = false; // Keep segment files out of the page cache, local filesystems only
+  bool m_nativeStorage = true; // Access files on local filesystems natively rather than through kodi's VFS
+};
+
+/*
+ * A reader's position within a segment, kept by the reader as a segment can be read by
+ * several readers at once
+ */
+struct TimeshiftSegmentReadPosition
+{
+  int m_packetIndex = 0;
+  int m_recoveryPointPacketIndex = -1;
+  // Packets from the read position up to here are known to be loaded from disk
+  int m_loadedPacketIndexEnd = 0;
+};
+
+/*
+ * Packets are added by the ingest thread while readers read them, which
+ * only needs the lock free packet list. The mutex guards the indexes used by seeks and
+ * the rest of the segment state which only changes on rare structural operations.
+ */
 class TimeshiftSegment
 {
 public:
-  TimeshiftSegment(IManageDemuxPacket* demuxPacketManager, const std::string& streamId, int segmentId, const std::string& timeshiftBufferPath);
+  // A recycled file already has the segment's filename and is overwritten, on local
+  // filesystems the file is preallocated to the expected size if one is given
+  TimeshiftSegment(TimeshiftSegmentWriter* segmentWriter, const std::string& streamId, int segmentId, const std::string& timeshiftBufferPath,
+                   const TimeshiftSegmentFileOptions& fileOptions = TimeshiftSegmentFileOptions(), bool recycledFile = false, int64_t preallocateSize = 0);
+  // A segment which is only ever held in memory and never touches the filesystem
+  TimeshiftSegment(const std::string& streamId, int segmentId);
   ~TimeshiftSegment();
 
-  void AddPacket(DEMUX_PACKET* packet);
-  DEMUX_PACKET* ReadPacket();
-  bool Seek(double timeMs);
+  void AddPacket(const DEMUX_PACKET* packet, bool videoKeyframe);
+  // Packets are allocated with the packet manager of the reader
+  DEMUX_PACKET* ReadPacket(IManageDemuxPacket* demuxPacketManager, TimeshiftSegmentReadPosition& position, bool* videoKeyframe = nullptr);
+  bool Seek(double timeMs, TimeshiftSegmentReadPosition& position);
+  // The pts of the packet at the position, e.g. the keyframe a seek starts from
+  double GetPacketPts(const TimeshiftSegmentReadPosition& position);
 
   int GetPacketCount();
+  bool IsFull();
+  int64_t GetFileSize();
+  size_t GetMemorySize();
   void MarkAsComplete();
-  bool HasPacketAvailable();
-  bool ReadAllPackets();
+  bool HasPacketAvailable(const TimeshiftSegmentReadPosition& position);
+  bool ReadAllPackets(const TimeshiftSegmentReadPosition& position);
   void SetNextSegment(std::shared_ptr<TimeshiftSegment> nextSegment);
   std::shared_ptr<TimeshiftSegment> GetNextSegment();
-  void ResetReadIndex();
-  int GetReadIndex();
   int GetSegmentId();
   void ClearPackets();
   void ForceLoadSegment();
   void LoadSegment();
 
-protected:
-  IManageDemuxPacket* m_demuxPacketManager;
-
 private:
-  void CopyPacket(DEMUX_PACKET* sourcePacket, DEMUX_PACKET* newPacket, bool allocateData);
-  void CopySideData(DEMUX_PACKET *sourcePacket, DEMUX_PACKET* newPacket);
-  void FreeSideData(std::shared_ptr<DEMUX_PACKET>& packet);
-  void WritePacket(std::shared_ptr<DEMUX_PACKET>& packet);
-  int LoadPacket(std::shared_ptr<DEMUX_PACKET>& packet);
+  static const size_t WRITE_BLOCK_SIZE = 1024 * 1024;
+  static const int64_t LOAD_BLOCK_SIZE = 512 * 1024;
+
+  void UpdateTimeIndex(int packetIndex, double pts, bool keyframe);
+  SegmentFileHeader CreateFileHeader();
+  void StorePacket(const DEMUX_PACKET* packet, int32_t packetIndex, bool keyframe, TimeshiftPacket& storedPacket);
+  void WriteToBuffer(const void* data, size_t size);
+  void QueueWriteBuffer();
+  bool ReadFileHeader(SegmentFileHeader& header);
+  bool ReadFileFooter(const SegmentFileHeader& header);
+  void LoadPackets();
+  void LoadCompressedPackets(const SegmentFileHeader& header);
+  void IndexPacketsFromFooter(const SegmentFileHeader& header);
+  void SetPacketRecords(const SegmentFileHeader& header, const uint8_t* data, int64_t dataOffset);
+  void ParsePackets(const uint8_t* data, const uint8_t* dataEnd);
+  void LoadPacketsFrom(int packetIndex);
+  void LoadLegacyPackets(int32_t packetCount);
+  int LoadLegacyPacket(TimeshiftPacket& packet);
+  DEMUX_PACKET* CreateDemuxPacket(IManageDemuxPacket* demuxPacketManager, const TimeshiftPacket& packet);
 
   std::shared_ptr<TimeshiftSegment> m_nextSegment;
 
   int32_t m_currentPacketIndex = 0;
-  int m_readPacketIndex = 0;
-  int m_lastPacketSecondsSinceStart = 0;
 
-  std::vector<std::shared_ptr<DEMUX_PACKET>> m_packetBuffer;
-  std::map<int, int> m_packetTimeIndexMap;
+  MemoryArena m_arena;
+  TimeshiftPacketList m_packets;
+  std::vector<PacketTimeIndex> m_packetTimeIndex;
+  std::vector<int> m_keyframePacketIndexes;
+  std::vector<SegmentFooterEntry> m_footerEntries;
+  int64_t m_packetDataEndOffset = 0;
 
-  bool m_completed = false;
+  std::atomic<bool> m_completed = {false};
   bool m_persisted = false;
-  bool m_loaded = true;
+  std::atomic<bool> m_loaded = {true};
+  bool m_loadPacketsOnDemand = false;
   bool m_persistSegments = true;
 
   int m_segmentId;
@@ -76,9 +150,18 @@ private:
   std::string m_streamId;
   std::string m_segmentFilename;
 
-  kodi::vfs::CFile m_fileHandle;
+  std::unique_ptr<TimeshiftFile> m_fileHandle;
+  TimeshiftSegmentWriter* m_segmentWriter = nullptr;
+  CompressionMethod m_compression = CompressionMethod::NONE;
+  bool m_limitPageCache = false;
+  std::vector<uint8_t> m_writeBuffer;
+  uint64_t m_lastWriteTicket = 0;
+  int64_t m_writeOffset = 0;
 
   std::string m_timeshiftSegmentFilePath;
+  std::string m_localSegmentFilePath;
+
+  MemoryMappedFile m_mappedFile;
 
   std::mutex m_mutex;
 };
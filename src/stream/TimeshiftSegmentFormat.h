@@ -0,0 +1,133 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace ffmpegdirect
+{
+
+/*
+ * On disk layout of a timeshift segment file (version 3):
+ *
+ *   SegmentFileHeader
+ *   packet records: SegmentPacketRecord, payload, side data, crypto info
+ *   footer: SegmentFooterEntry for each packet
+ *
+ * If the header has a compression method everything after the header is stored as a
+ * sequence of blocks, each a SegmentBlockHeader followed by the compressed data. A block
+ * with a stored size equal to its size was not compressible and is stored as is. All
+ * offsets, including the footer offset, refer to the data before compression. The header
+ * itself is never compressed.
+ *
+ * All fields are fixed width and written in host byte order. The header is written
+ * with a packet count and footer offset of zero when the segment is created and
+ * rewritten once the segment is complete. A footer offset of zero therefore means
+ * the segment was never completed and can only be read from front to back.
+ *
+ * Files written before version 2 have no header, they start with an int32 packet
+ * count which can never match the magic value.
+ */
+
+static const uint32_t SEGMENT_FILE_MAGIC = 0x53544446; // "FDTS"
+static const uint16_t SEGMENT_FILE_VERSION = 3;
+static const int SEGMENT_FILE_STREAM_ID_LENGTH = 32;
+
+static const uint8_t SEGMENT_PACKET_FLAG_KEYFRAME = 0x01; // A video keyframe as flagged by the demuxer
+static const uint8_t SEGMENT_PACKET_FLAG_CRYPTO_INFO = 0x02;
+
+/*
+ * The segment index file (.idx) of a stream is a SegmentIndexFileHeader followed by a
+ * SegmentIndexRecord for each completed segment, appended in segment ID order.
+ */
+
+static const uint32_t SEGMENT_INDEX_FILE_MAGIC = 0x49544446; // "FDTI"
+static const uint16_t SEGMENT_INDEX_FILE_VERSION = 2;
+
+#pragma pack(push, 1)
+
+struct SegmentFileHeader
+{
+  uint32_t m_magic = SEGMENT_FILE_MAGIC;
+  uint16_t m_version = SEGMENT_FILE_VERSION;
+  uint16_t m_headerSize = sizeof(SegmentFileHeader);
+  int32_t m_segmentId = 0;
+  int32_t m_packetCount = 0;
+  int64_t m_footerOffset = 0;
+  char m_streamId[SEGMENT_FILE_STREAM_ID_LENGTH] = {};
+  uint8_t m_compression = 0; // CompressionMethod, version 3 and later
+  uint8_t m_reserved[7] = {};
+};
+
+struct SegmentPacketRecord
+{
+  int32_t m_packetIndex;
+  int32_t m_size;
+  int32_t m_streamId;
+  int64_t m_demuxerId;
+  int32_t m_groupId;
+  double m_pts;
+  double m_dts;
+  double m_duration;
+  int32_t m_dispTime;
+  uint8_t m_recoveryPoint;
+  uint8_t m_flags;
+  uint16_t m_sideDataElems;
+};
+
+struct SegmentSideDataRecord
+{
+  uint32_t m_type;
+  uint32_t m_size;
+};
+
+struct SegmentCryptoRecord
+{
+  uint16_t m_numSubSamples;
+  uint16_t m_flags;
+  uint8_t m_iv[16];
+  uint8_t m_kid[16];
+};
+
+struct SegmentBlockHeader
+{
+  uint32_t m_storedSize;
+  uint32_t m_size;
+};
+
+struct SegmentFooterEntry
+{
+  int32_t m_packetIndex;
+  int64_t m_offset;
+  double m_pts;
+  uint8_t m_keyframe;
+};
+
+struct SegmentIndexRecord
+{
+  int32_t m_segmentId;
+  int64_t m_timeIndexStart; // milliseconds, version 2 and later
+  int64_t m_timeIndexEnd;
+  int64_t m_byteSize;
+};
+
+struct SegmentIndexFileHeader
+{
+  uint32_t m_magic = SEGMENT_INDEX_FILE_MAGIC;
+  uint16_t m_version = SEGMENT_INDEX_FILE_VERSION;
+  uint16_t m_recordSize = sizeof(SegmentIndexRecord);
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(SegmentFileHeader) == 64, "Unexpected segment file header size");
+static_assert(sizeof(SegmentPacketRecord) == 56, "Unexpected segment packet record size");
+static_assert(sizeof(SegmentFooterEntry) == 21, "Unexpected segment footer entry size");
+static_assert(sizeof(SegmentIndexRecord) == 28, "Unexpected segment index record size");
+
+} //namespace ffmpegdirect
@@ -0,0 +1,206 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftSegmentJanitor.h"
+
+#include "url/URL.h"
+#include "../utils/Log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <map>
+#include <vector>
+
+#include <kodi/Filesystem.h>
+#include <kodi/tools/StringUtils.h>
+
+using namespace ffmpegdirect;
+using namespace kodi::tools;
+
+TimeshiftSegmentJanitor& TimeshiftSegmentJanitor::GetInstance()
+{
+  static TimeshiftSegmentJanitor janitor;
+  return janitor;
+}
+
+TimeshiftSegmentJanitor::~TimeshiftSegmentJanitor()
+{
+  Stop();
+}
+
+void TimeshiftSegmentJanitor::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running = false;
+  }
+  m_queueCondition.notify_all();
+
+  if (m_janitorThread.joinable())
+    m_janitorThread.join();
+}
+
+void TimeshiftSegmentJanitor::RegisterStream(const std::string& streamId)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_activeStreamIds.insert(streamId);
+}
+
+void TimeshiftSegmentJanitor::UnregisterStream(const std::string& streamId)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_activeStreamIds.erase(streamId);
+}
+
+void TimeshiftSegmentJanitor::QueueDelete(const std::string& filePath)
+{
+  Queue({filePath, false});
+}
+
+void TimeshiftSegmentJanitor::QueueOrphanSweep(const std::string& timeshiftBufferPath)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_sweptPaths.insert(timeshiftBufferPath).second)
+      return;
+  }
+
+  Queue({timeshiftBufferPath, true});
+}
+
+void TimeshiftSegmentJanitor::Queue(JanitorTask&& task)
+{
+  std::thread stoppedThread;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.emplace_back(std::move(task));
+
+    if (!m_running)
+    {
+      // A thread from before Stop() has already finished, it only needs joining
+      stoppedThread = std::move(m_janitorThread);
+
+      m_running = true;
+      m_janitorThread = std::thread([&] { Process(); });
+    }
+  }
+  m_queueCondition.notify_one();
+
+  if (stoppedThread.joinable())
+    stoppedThread.join();
+}
+
+void TimeshiftSegmentJanitor::Process()
+{
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment janitor: started", __FUNCTION__);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    m_queueCondition.wait(lock, [&] { return !m_running || !m_queue.empty(); });
+
+    // Always drain the queue before stopping so no files are left behind
+    if (m_queue.empty())
+      break;
+
+    JanitorTask task = std::move(m_queue.front());
+    m_queue.pop_front();
+    lock.unlock();
+
+    if (task.m_sweep)
+    {
+      SweepOrphans(task.m_path);
+    }
+    else if (!kodi::vfs::DeleteFile(task.m_path))
+    {
+      Log(LOGLEVEL_DEBUG, "%s - Failed to delete timeshift file: %s", __FUNCTION__, CURL::GetRedacted(task.m_path).c_str());
+    }
+
+    lock.lock();
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment janitor: stopped", __FUNCTION__);
+}
+
+void TimeshiftSegmentJanitor::SweepOrphans(const std::string& timeshiftBufferPath)
+{
+  std::vector<kodi::vfs::CDirEntry> items;
+  if (!kodi::vfs::GetDirectory(timeshiftBufferPath, ".seg|.idx", items))
+    return;
+
+  struct StreamFiles
+  {
+    time_t m_lastModified = 0;
+    std::vector<std::string> m_paths;
+  };
+
+  // A stream is judged by its most recently written file, older segments of a stream
+  // still being written can be hours old
+  std::map<std::string, StreamFiles> streams;
+  for (const auto& item : items)
+  {
+    std::string streamId;
+    if (item.IsFolder() || !GetStreamIdFromFilename(item.Label(), streamId))
+      continue;
+
+    StreamFiles& streamFiles = streams[streamId];
+    streamFiles.m_paths.emplace_back(item.Path());
+
+    kodi::vfs::FileStatus status;
+    if (kodi::vfs::StatFile(item.Path(), status))
+      streamFiles.m_lastModified = std::max(streamFiles.m_lastModified, status.GetModificationTime());
+    else
+      streamFiles.m_lastModified = std::time(nullptr); // Can't tell so leave it be
+  }
+
+  const time_t now = std::time(nullptr);
+  int deletedFileCount = 0;
+  for (const auto& stream : streams)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_activeStreamIds.find(stream.first) != m_activeStreamIds.end())
+        continue;
+    }
+
+    if (now - stream.second.m_lastModified < ORPHAN_MIN_AGE_SECS)
+      continue;
+
+    for (const auto& path : stream.second.m_paths)
+    {
+      if (kodi::vfs::DeleteFile(path))
+        deletedFileCount++;
+    }
+  }
+
+  if (deletedFileCount > 0)
+    Log(LOGLEVEL_INFO, "%s - Deleted %d orphaned timeshift files from: %s", __FUNCTION__, deletedFileCount, CURL::GetRedacted(timeshiftBufferPath).c_str());
+}
+
+bool TimeshiftSegmentJanitor::GetStreamIdFromFilename(const std::string& filename, std::string& streamId)
+{
+  // Files are named <stream id>.idx and <stream id>-<segment id>.seg, stream IDs are numeric
+  if (StringUtils::EndsWith(filename, ".idx"))
+  {
+    streamId = filename.substr(0, filename.size() - 4);
+  }
+  else if (StringUtils::EndsWith(filename, ".seg"))
+  {
+    const size_t separator = filename.rfind('-');
+    if (separator == std::string::npos)
+      return false;
+    streamId = filename.substr(0, separator);
+  }
+  else
+  {
+    return false;
+  }
+
+  return !streamId.empty() && std::all_of(streamId.cbegin(), streamId.cend(), [](unsigned char c) { return std::isdigit(c); });
+}
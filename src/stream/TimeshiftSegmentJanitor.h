@@ -0,0 +1,76 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace ffmpegdirect
+{
+
+/*
+ * Deletes timeshift files on a dedicated thread so that neither the ingest thread
+ * nor closing a stream has to wait on storage, which can take seconds on network shares.
+ *
+ * There is a single janitor for all streams. It outlives the streams that queue work
+ * so files are still deleted after a stream has been closed, the thread is started on
+ * first use and the queue is drained when the addon is unloaded.
+ *
+ * The first time a buffer path is used it's also swept for files left behind by
+ * sessions which were never closed, e.g. after a crash. Files belonging to a stream
+ * of this process or written to recently, possibly by another instance sharing the
+ * path, are never swept.
+ */
+class TimeshiftSegmentJanitor
+{
+public:
+  static TimeshiftSegmentJanitor& GetInstance();
+  ~TimeshiftSegmentJanitor();
+
+  /*
+   * Deletes everything queued so far and stops the thread.
+   */
+  void Stop();
+
+  void RegisterStream(const std::string& streamId);
+  void UnregisterStream(const std::string& streamId);
+
+  void QueueDelete(const std::string& filePath);
+  void QueueOrphanSweep(const std::string& timeshiftBufferPath);
+
+private:
+  static const int ORPHAN_MIN_AGE_SECS = 10 * 60;
+
+  struct JanitorTask
+  {
+    std::string m_path;
+    bool m_sweep;
+  };
+
+  TimeshiftSegmentJanitor() = default;
+
+  void Queue(JanitorTask&& task);
+  void Process();
+  void SweepOrphans(const std::string& timeshiftBufferPath);
+  static bool GetStreamIdFromFilename(const std::string& filename, std::string& streamId);
+
+  std::deque<JanitorTask> m_queue;
+  std::set<std::string> m_activeStreamIds;
+  std::set<std::string> m_sweptPaths;
+
+  bool m_running = false;
+  std::thread m_janitorThread;
+  std::condition_variable m_queueCondition;
+  std::mutex m_mutex;
+};
+
+} //namespace ffmpegdirect
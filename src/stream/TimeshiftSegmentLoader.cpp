@@ -0,0 +1,199 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftSegmentLoader.h"
+
+#include "../utils/DiskUtils.h"
+#include "../utils/Log.h"
+
+#include <kodi/Filesystem.h>
+#include <kodi/tools/StringUtils.h>
+
+using namespace ffmpegdirect;
+using namespace kodi::tools;
+
+TimeshiftSegmentLoader::TimeshiftSegmentLoader(TimeshiftSegmentWriter* segmentWriter)
+  : m_segmentWriter(segmentWriter)
+{
+}
+
+TimeshiftSegmentLoader::~TimeshiftSegmentLoader()
+{
+  Stop();
+}
+
+void TimeshiftSegmentLoader::Start(const std::string& streamId, const std::string& timeshiftBufferPath, const TimeshiftSegmentFileOptions& fileOptions)
+{
+  if (m_running)
+    return;
+
+  m_streamId = streamId;
+  m_timeshiftBufferPath = timeshiftBufferPath;
+  m_fileOptions = fileOptions;
+
+  if (!m_fileOptions.m_limitPageCache || !DiskUtils::GetLocalPath(timeshiftBufferPath, m_localBufferPath))
+    m_localBufferPath.clear();
+
+  m_running = true;
+  m_loaderThread = std::thread([&] { Process(); });
+}
+
+void TimeshiftSegmentLoader::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running = false;
+  }
+  m_requestCondition.notify_all();
+
+  if (m_loaderThread.joinable())
+    m_loaderThread.join();
+
+  // Make sure no segment file is left open so it can be deleted
+  m_loadedSegments.clear();
+  m_loadedCondition.notify_all();
+}
+
+void TimeshiftSegmentLoader::RequestSegments(const TimeshiftReadCursor* cursor, int firstSegmentId, int lastSegmentId)
+{
+  std::map<int, std::shared_ptr<TimeshiftSegment>> releasedSegments;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto request = m_requestedRanges.find(cursor);
+    if (lastSegmentId < firstSegmentId)
+    {
+      if (request == m_requestedRanges.end())
+        return;
+      m_requestedRanges.erase(request);
+    }
+    else
+    {
+      if (request != m_requestedRanges.end() &&
+          request->second.m_firstSegmentId == firstSegmentId && request->second.m_lastSegmentId == lastSegmentId)
+        return;
+      m_requestedRanges[cursor] = {firstSegmentId, lastSegmentId};
+    }
+
+    for (auto it = m_loadedSegments.begin(); it != m_loadedSegments.end();)
+    {
+      if (!IsRequested(it->first))
+      {
+        releasedSegments.insert(*it);
+        it = m_loadedSegments.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  // Released segments are destroyed here, outside of the lock
+  m_requestCondition.notify_one();
+}
+
+std::shared_ptr<TimeshiftSegment> TimeshiftSegmentLoader::TakeSegment(int segmentId)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  m_loadedCondition.wait(lock, [&] { return !m_running || m_loadingSegmentId != segmentId; });
+
+  // The segment stays loaded until no reader's range has it, so readers close together share it
+  auto it = m_loadedSegments.find(segmentId);
+  if (it != m_loadedSegments.end())
+    return it->second;
+
+  return nullptr;
+}
+
+bool TimeshiftSegmentLoader::GetNextSegmentIdToLoad(int& segmentId, int& lastRequestedSegmentId)
+{
+  for (const auto& request : m_requestedRanges)
+  {
+    for (int id = request.second.m_firstSegmentId; id <= request.second.m_lastSegmentId; id++)
+    {
+      if (m_loadedSegments.find(id) == m_loadedSegments.end())
+      {
+        segmentId = id;
+        lastRequestedSegmentId = request.second.m_lastSegmentId;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool TimeshiftSegmentLoader::IsRequested(int segmentId)
+{
+  for (const auto& request : m_requestedRanges)
+  {
+    if (segmentId >= request.second.m_firstSegmentId && segmentId <= request.second.m_lastSegmentId)
+      return true;
+  }
+
+  return false;
+}
+
+void TimeshiftSegmentLoader::Process()
+{
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment loader: started", __FUNCTION__);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    int segmentId = -1;
+    int lastRequestedSegmentId = -1;
+    m_requestCondition.wait(lock, [&] { return !m_running || GetNextSegmentIdToLoad(segmentId, lastRequestedSegmentId); });
+
+    if (!m_running)
+      break;
+
+    m_loadingSegmentId = segmentId;
+    lock.unlock();
+
+    // Let the OS read the files of the rest of the range while this segment loads
+    if (!m_localBufferPath.empty())
+    {
+      if (m_lastAdvisedSegmentId < segmentId || m_lastAdvisedSegmentId > lastRequestedSegmentId)
+        m_lastAdvisedSegmentId = segmentId;
+
+      for (int id = m_lastAdvisedSegmentId + 1; id <= lastRequestedSegmentId; id++)
+        DiskUtils::AdviseFileAccess(m_localBufferPath + "/" + StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), id), FileAccessAdvice::WILL_NEED);
+      m_lastAdvisedSegmentId = lastRequestedSegmentId;
+    }
+
+    std::shared_ptr<TimeshiftSegment> segment;
+
+    // Never create a segment for a file that doesn't exist as that would create it for writing
+    std::string segmentFilename = StringUtils::Format("%s-%08d.seg", m_streamId.c_str(), segmentId);
+    if (kodi::vfs::FileExists(m_timeshiftBufferPath + "/" + segmentFilename))
+    {
+      segment = std::make_shared<TimeshiftSegment>(m_segmentWriter, m_streamId, segmentId, m_timeshiftBufferPath, m_fileOptions);
+      segment->ForceLoadSegment();
+
+      Log(LOGLEVEL_DEBUG, "%s - Read ahead segment with id: %d, packet count: %d", __FUNCTION__, segmentId, segment->GetPacketCount());
+    }
+    else
+    {
+      Log(LOGLEVEL_DEBUG, "%s - Read ahead segment with id: %d not found on disk", __FUNCTION__, segmentId);
+    }
+
+    lock.lock();
+    m_loadingSegmentId = -1;
+
+    // The requests may have moved on while the segment was loading
+    if (IsRequested(segmentId))
+      m_loadedSegments[segmentId] = segment;
+
+    m_loadedCondition.notify_all();
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment loader: stopped", __FUNCTION__);
+}
@@ -0,0 +1,89 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "TimeshiftSegment.h"
+#include "TimeshiftSegmentWriter.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace ffmpegdirect
+{
+
+struct TimeshiftReadCursor;
+
+/*
+ * Loads on disk segments ahead of the readers on a dedicated thread so that moving
+ * to the next segment during playback doesn't have to wait on storage. A buffer has
+ * one loader shared by all of its readers.
+ *
+ * The buffer requests a range of segment IDs for a reader each time its read position
+ * changes, segments outside of every reader's range are released. Once loaded a segment
+ * can be taken by a reader, it's kept for any other reader whose range it's still in.
+ * When managing the page cache the OS is told to read the files of the rest of the
+ * range while a segment loads.
+ */
+class TimeshiftSegmentLoader
+{
+public:
+  TimeshiftSegmentLoader(TimeshiftSegmentWriter* segmentWriter);
+  ~TimeshiftSegmentLoader();
+
+  void Start(const std::string& streamId, const std::string& timeshiftBufferPath, const TimeshiftSegmentFileOptions& fileOptions);
+  void Stop();
+
+  /*
+   * Load the segments from first to last segment ID in the background for the reader. An
+   * empty range, i.e. a last segment ID lower than the first, removes the reader's request.
+   */
+  void RequestSegments(const TimeshiftReadCursor* cursor, int firstSegmentId, int lastSegmentId);
+
+  /*
+   * Returns the segment if it has been loaded, waiting for it if it's currently loading,
+   * or nullptr if it hasn't been requested or could not be loaded.
+   */
+  std::shared_ptr<TimeshiftSegment> TakeSegment(int segmentId);
+
+private:
+  struct SegmentRange
+  {
+    int m_firstSegmentId;
+    int m_lastSegmentId;
+  };
+
+  void Process();
+  bool GetNextSegmentIdToLoad(int& segmentId, int& lastRequestedSegmentId);
+  bool IsRequested(int segmentId);
+
+  TimeshiftSegmentWriter* m_segmentWriter;
+  std::string m_streamId;
+  std::string m_timeshiftBufferPath;
+  TimeshiftSegmentFileOptions m_fileOptions;
+  // Only set when the page cache is managed, the last segment the OS has been told will be needed
+  std::string m_localBufferPath;
+  int m_lastAdvisedSegmentId = -1;
+
+  // A null segment means the segment could not be loaded
+  std::map<int, std::shared_ptr<TimeshiftSegment>> m_loadedSegments;
+  std::map<const TimeshiftReadCursor*, SegmentRange> m_requestedRanges;
+  int m_loadingSegmentId = -1;
+
+  std::atomic<bool> m_running = {false};
+  std::thread m_loaderThread;
+  std::condition_variable m_requestCondition;
+  std::condition_variable m_loadedCondition;
+  std::mutex m_mutex;
+};
+
+} //namespace ffmpegdirect
@@ -0,0 +1,207 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftSegmentWriter.h"
+
+#include "TimeshiftSegmentFormat.h"
+#include "../utils/DiskUtils.h"
+#include "../utils/Log.h"
+
+#include <cstring>
+#include <ctime>
+
+using namespace ffmpegdirect;
+
+namespace
+{
+
+// CPU time of the calling thread, so time the writer thread spends descheduled isn't counted
+std::chrono::microseconds GetThreadCpuTime()
+{
+#if defined(TARGET_POSIX)
+  timespec cpuTime;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpuTime) == 0)
+    return std::chrono::seconds(cpuTime.tv_sec) + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(cpuTime.tv_nsec));
+#endif
+
+  // Elsewhere the process' CPU time is the closest available
+  return std::chrono::microseconds(static_cast<int64_t>(std::clock()) * 1000000 / CLOCKS_PER_SEC);
+}
+
+} // unnamed namespace
+
+TimeshiftSegmentWriter::~TimeshiftSegmentWriter()
+{
+  Stop();
+}
+
+void TimeshiftSegmentWriter::Start()
+{
+  if (m_running)
+    return;
+
+  m_running = true;
+  m_writerThread = std::thread([&] { Process(); });
+}
+
+void TimeshiftSegmentWriter::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_running = false;
+  }
+  m_queueCondition.notify_all();
+
+  if (m_writerThread.joinable())
+  {
+    m_writerThread.join();
+    LogStatistics();
+  }
+
+  m_writtenCondition.notify_all();
+}
+
+uint64_t TimeshiftSegmentWriter::QueueWrite(TimeshiftFile* fileHandle, std::vector<uint8_t>&& data, int64_t position, CompressionMethod compression,
+                                            const std::string& dropBehindPath)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // Backpressure, if the disk can't keep up the ingest thread waits here
+  // A single block larger than the limit is still accepted once the queue drains
+  m_writtenCondition.wait(lock, [&] { return !m_running || m_queue.empty() || m_queuedBytes + data.size() <= MAX_QUEUED_BYTES; });
+
+  uint64_t ticket = ++m_lastQueuedTicket;
+
+  if (!m_running)
+  {
+    // Nothing left to write with, so write inline to avoid losing data
+    // but only once anything still queued has been written to keep the order
+    m_writtenCondition.wait(lock, [&] { return m_queue.empty(); });
+    WriteRequest request{fileHandle, position, std::move(data), ticket, compression, dropBehindPath};
+    Write(request);
+    m_lastWrittenTicket = ticket;
+    return ticket;
+  }
+
+  m_queuedBytes += data.size();
+  m_queue.push_back({fileHandle, position, std::move(data), ticket, compression, dropBehindPath});
+  lock.unlock();
+
+  m_queueCondition.notify_one();
+
+  return ticket;
+}
+
+void TimeshiftSegmentWriter::WaitForWrite(uint64_t ticket)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_writtenCondition.wait(lock, [&] { return m_lastWrittenTicket >= ticket || (!m_running && m_queue.empty()); });
+}
+
+void TimeshiftSegmentWriter::Process()
+{
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment writer: started", __FUNCTION__);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    m_queueCondition.wait(lock, [&] { return !m_running || !m_queue.empty(); });
+
+    // Always drain the queue before stopping so no segment data is lost
+    if (m_queue.empty())
+      break;
+
+    WriteRequest request = std::move(m_queue.front());
+    m_queue.pop_front();
+    lock.unlock();
+
+    const size_t queuedSize = request.m_data.size();
+    Write(request);
+
+    lock.lock();
+    m_queuedBytes -= queuedSize;
+    m_lastWrittenTicket = request.m_ticket;
+    m_writtenCondition.notify_all();
+  }
+
+  Log(LOGLEVEL_DEBUG, "%s - Timeshift segment writer: stopped", __FUNCTION__);
+}
+
+void TimeshiftSegmentWriter::Write(WriteRequest& request)
+{
+  if (request.m_compression != CompressionMethod::NONE)
+    CompressBlock(request);
+
+  const auto startTime = std::chrono::steady_clock::now();
+
+  ssize_t written;
+  if (request.m_position >= 0)
+    written = request.m_fileHandle->WriteAt(request.m_data.data(), request.m_data.size(), request.m_position);
+  else
+    written = request.m_fileHandle->Write(request.m_data.data(), request.m_data.size());
+
+  if (written != static_cast<ssize_t>(request.m_data.size()))
+    Log(LOGLEVEL_ERROR, "%s - Failed to write segment data, wrote %lld of %lld bytes", __FUNCTION__, static_cast<long long>(written), static_cast<long long>(request.m_data.size()));
+
+  if (request.m_position < 0 && !request.m_dropBehindPath.empty() && written > 0)
+    DiskUtils::DropBehind(request.m_dropBehindPath, request.m_fileHandle->GetPosition() - written, written);
+
+  m_bytesWritten += written > 0 ? written : 0;
+  m_writeTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+  m_backendName = request.m_fileHandle->GetBackendName();
+}
+
+void TimeshiftSegmentWriter::CompressBlock(WriteRequest& request)
+{
+  const std::chrono::microseconds startCpuTime = GetThreadCpuTime();
+
+  SegmentBlockHeader blockHeader;
+  blockHeader.m_size = static_cast<uint32_t>(request.m_data.size());
+
+  std::vector<uint8_t> compressedData;
+  const uint8_t* blockData = request.m_data.data();
+  if (CompressionUtils::Compress(request.m_compression, request.m_data.data(), request.m_data.size(), compressedData) &&
+      compressedData.size() < request.m_data.size())
+  {
+    blockData = compressedData.data();
+    blockHeader.m_storedSize = static_cast<uint32_t>(compressedData.size());
+  }
+  else
+  {
+    // Not compressible, e.g. most video, so store it as is
+    blockHeader.m_storedSize = blockHeader.m_size;
+  }
+
+  std::vector<uint8_t> block(sizeof(blockHeader) + blockHeader.m_storedSize);
+  memcpy(block.data(), &blockHeader, sizeof(blockHeader));
+  memcpy(block.data() + sizeof(blockHeader), blockData, blockHeader.m_storedSize);
+  request.m_data = std::move(block);
+
+  m_compressedBlockBytes += blockHeader.m_size;
+  m_compressedBlockBytesWritten += request.m_data.size();
+  m_compressionCpuTime += GetThreadCpuTime() - startCpuTime;
+}
+
+void TimeshiftSegmentWriter::LogStatistics()
+{
+  // The throughput of the storage backends can be compared by running the same stream with and without native storage
+  if (m_bytesWritten > 0)
+  {
+    const long long writeTimeMs = static_cast<long long>(m_writeTime.count() / 1000);
+    const double megabytesPerSecond = m_writeTime.count() > 0 ? static_cast<double>(m_bytesWritten) / m_writeTime.count() : 0.0;
+    Log(LOGLEVEL_INFO, "%s - Timeshift segment writer: %llu bytes written in %lld ms using the '%s' storage backend, %.1f MB/s",
+        __FUNCTION__, static_cast<unsigned long long>(m_bytesWritten), writeTimeMs, m_backendName, megabytesPerSecond);
+  }
+
+  if (m_compressedBlockBytes == 0)
+    return;
+
+  const long long bytesSaved = static_cast<long long>(m_compressedBlockBytes) - static_cast<long long>(m_compressedBlockBytesWritten);
+  Log(LOGLEVEL_INFO, "%s - Timeshift segment compression: %llu bytes written for %llu bytes of data, %lld bytes saved (%.1f%%), compression CPU time: %lld ms",
+      __FUNCTION__, static_cast<unsigned long long>(m_compressedBlockBytesWritten), static_cast<unsigned long long>(m_compressedBlockBytes),
+      bytesSaved, 100.0 * bytesSaved / m_compressedBlockBytes, static_cast<long long>(m_compressionCpuTime.count() / 1000));
+}
@@ -0,0 +1,95 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "../utils/CompressionUtils.h"
+#include "TimeshiftFile.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ffmpegdirect
+{
+
+/*
+ * Writes serialized segment data to disk on a dedicated thread so that the
+ * ingest thread only ever has to append to an in memory buffer.
+ *
+ * Requests are processed in order. Each one is given a ticket which can be
+ * waited on, e.g. before closing a file handle. The queue is bounded by size,
+ * once full QueueWrite() blocks until the writer has caught up.
+ *
+ * Blocks can optionally be compressed, which is also done on the writer thread.
+ */
+class TimeshiftSegmentWriter
+{
+public:
+  TimeshiftSegmentWriter() = default;
+  ~TimeshiftSegmentWriter();
+
+  void Start();
+  void Stop();
+
+  /*
+   * Queue a block of data to be written to a file. A position of -1 appends at the
+   * current file position, any other value writes at that position and then returns to
+   * the end of the file. The caller must keep the file handle open until the returned
+   * ticket has been waited on. A compressed block is written as a SegmentBlockHeader
+   * followed by the compressed data. If a drop behind path is given, which must be the
+   * local filesystem path of the file, appended data is dropped from the page cache.
+   */
+  uint64_t QueueWrite(TimeshiftFile* fileHandle, std::vector<uint8_t>&& data, int64_t position = -1, CompressionMethod compression = CompressionMethod::NONE,
+                      const std::string& dropBehindPath = std::string());
+  void WaitForWrite(uint64_t ticket);
+
+private:
+  static const size_t MAX_QUEUED_BYTES = 16 * 1024 * 1024;
+
+  struct WriteRequest
+  {
+    TimeshiftFile* m_fileHandle;
+    int64_t m_position;
+    std::vector<uint8_t> m_data;
+    uint64_t m_ticket;
+    CompressionMethod m_compression;
+    std::string m_dropBehindPath;
+  };
+
+  void Process();
+  void Write(WriteRequest& request);
+  void CompressBlock(WriteRequest& request);
+  void LogStatistics();
+
+  std::deque<WriteRequest> m_queue;
+  size_t m_queuedBytes = 0;
+  uint64_t m_lastQueuedTicket = 0;
+  uint64_t m_lastWrittenTicket = 0;
+
+  // Only updated by whichever thread is writing
+  uint64_t m_compressedBlockBytes = 0;
+  uint64_t m_compressedBlockBytesWritten = 0;
+  std::chrono::microseconds m_compressionCpuTime{0};
+  uint64_t m_bytesWritten = 0;
+  std::chrono::microseconds m_writeTime{0};
+  const char* m_backendName = "";
+
+  std::atomic<bool> m_running = {false};
+  std::thread m_writerThread;
+  std::condition_variable m_queueCondition;
+  std::condition_variable m_writtenCondition;
+  std::mutex m_mutex;
+};
+
+} //namespace ffmpegdirect
@@ -7,8 +7,13 @@
 
 #include "TimeshiftStream.h"
 
+#include "TimeshiftExporter.h"
+#include "TimeshiftStreamRegistry.h"
+#include "url/URL.h"
 #include "../utils/Log.h"
 
+#include <algorithm>
+
 #ifndef __STDC_CONSTANT_MACROS
 #define __STDC_CONSTANT_MACROS
 #endif
@@ -24,7 +29,8 @@ using namespace ffmpegdirect;
 TimeshiftStream::TimeshiftStream(IManageDemuxPacket* demuxPacketManager,
                                  const Properties& props,
                                  const HttpProxy& httpProxy)
-  : FFmpegStream(demuxPacketManager, props, httpProxy)
+  : FFmpegStream(demuxPacketManager, props, httpProxy),
+    m_properties(props)
 {
   std::random_device randomDevice; //Will be used to obtain a seed for the random number engine
   m_randomGenerator = std::mt19937(randomDevice()); //Standard mersenne_twister_engine seeded with randomDevice()
@@ -38,10 +44,26 @@ TimeshiftStream::~TimeshiftStream()
 
 bool TimeshiftStream::Open(const std::string& streamUrl, const std::string& mimeType, bool isRealTimeStream, const std::string& programProperty)
 {
+  bool shareBuffer = true;
+  if (!kodi::addon::CheckSettingBoolean("timeshiftShareBuffer", shareBuffer))
+    shareBuffer = true;
+
+  if (shareBuffer)
+  {
+    m_registryKey = TimeshiftStreamRegistry::GetKey(streamUrl, programProperty);
+    if (AttachToIngest(streamUrl))
+      return true;
+  }
+
   if (FFmpegStream::Open(streamUrl, mimeType, isRealTimeStream, programProperty))
   {
     if (Start())
+    {
+      // Streams opened later for the same URL can now read from this one
+      if (shareBuffer)
+        TimeshiftStreamRegistry::GetInstance().Register(m_registryKey, shared_from_this());
       return true;
+    }
     else
       Close();
   }
@@ -49,12 +71,141 @@ bool TimeshiftStream::Open(const std::string& streamUrl, const std::string& mime
   return false;
 }
 
+bool TimeshiftStream::AttachToIngest(const std::string& streamUrl)
+{
+  std::shared_ptr<TimeshiftStream> ingestStream = TimeshiftStreamRegistry::GetInstance().Find(m_registryKey);
+  if (!ingestStream || !ingestStream->AddReader(this))
+    return false;
+
+  m_ingestStream = ingestStream;
+  m_timeshiftBuffer = ingestStream->m_timeshiftBuffer;
+  m_cursor = m_timeshiftBuffer->AddReader(m_demuxPacketManager);
+  m_streamUrl = streamUrl;
+  m_readerOpen = true;
+
+  Log(LOGLEVEL_INFO, "%s - Timeshift: reading the buffer of the stream already open for: %s", __FUNCTION__, CURL::GetRedacted(streamUrl).c_str());
+
+  return true;
+}
+
+bool TimeshiftStream::AddReader(TimeshiftStream* reader)
+{
+  std::lock_guard<std::mutex> lock(m_readersMutex);
+
+  // Once stopping no new readers can be added
+  if (!m_running)
+    return false;
+
+  m_readers.emplace_back(reader);
+  return true;
+}
+
+void TimeshiftStream::ReleaseReader(TimeshiftStream* reader)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_readersMutex);
+
+    m_readers.erase(std::remove(m_readers.begin(), m_readers.end(), reader), m_readers.end());
+    if (!m_readers.empty())
+    {
+      Log(LOGLEVEL_DEBUG, "%s - Timeshift: ingest continues for %d readers", __FUNCTION__, static_cast<int>(m_readers.size()));
+      return;
+    }
+
+    m_running = false;
+  }
+
+  StopIngest();
+}
+
+void TimeshiftStream::StopIngest()
+{
+  if (!m_registryKey.empty())
+    TimeshiftStreamRegistry::GetInstance().Unregister(m_registryKey, this);
+
+  m_running = false;
+  if (m_inputThread.joinable())
+    m_inputThread.join();
+
+  // Exports still reading the buffer no longer wait for packets after the last one added
+  if (m_timeshiftBuffer)
+    m_timeshiftBuffer->SetIngestRunning(false);
+
+  FFmpegStream::Close();
+}
+
 DEMUX_PACKET* TimeshiftStream::DemuxRead()
 {
-  std::unique_lock<std::mutex> lock(m_mutex);
-  m_condition.wait_for(lock, std::chrono::milliseconds(10), [&] { return m_timeshiftBuffer.HasPacketAvailable(); });
+  if (!m_cursor)
+    return nullptr;
+
+  if (m_timeshiftBuffer->IsTrickPlay(*m_cursor))
+  {
+    DEMUX_PACKET* packet = m_timeshiftBuffer->ReadPacket(*m_cursor);
+    if (packet && packet->iSize > 0)
+      return packet;
+
+    // Keyframes are paced by time rather than by ingest, so wait for the next frame interval
+    // unless the speed changes first. The empty packet then tells the player to read again.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait_for(lock, std::chrono::milliseconds(TimeshiftBuffer::TRICK_PLAY_FRAME_INTERVAL_MS),
+                         [&] { return m_abortRead || !m_readerOpen || !m_timeshiftBuffer->IsTrickPlay(*m_cursor); });
 
-  return m_timeshiftBuffer.ReadPacket();
+    if (m_abortRead || !m_readerOpen)
+    {
+      m_abortRead = false;
+      if (packet)
+        m_cursor->m_demuxPacketManager->FreeDemuxPacketFromInputStreamAPI(packet);
+      return nullptr;
+    }
+
+    return packet;
+  }
+
+  if (!m_timeshiftBuffer->HasPacketAvailable(*m_cursor))
+  {
+    // There is no timed polling, the reader is only woken when a packet is published,
+    // after a seek, on abort or when the stream is closed
+    const auto startTime = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    TimeshiftStream& ingestStream = GetIngestStream();
+    m_readerWaiting = true;
+    ingestStream.m_waitingReaderCount++;
+    // Pairs with the fence in WriteDemuxPacket(), either the predicate sees the
+    // published packet or the ingest thread sees the reader waiting and notifies it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int wakeups = 0;
+    m_condition.wait(lock, [&] { wakeups++; return m_abortRead || !m_readerOpen || m_timeshiftBuffer->HasPacketAvailable(*m_cursor); });
+    ingestStream.m_waitingReaderCount--;
+    m_readerWaiting = false;
+
+    // The predicate is checked once before waiting and once per wakeup, only the last wakeup found something
+    m_readWaitCount++;
+    if (wakeups > 2)
+      m_emptyWakeupCount += wakeups - 2;
+    m_readWaitTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+
+    if (m_abortRead)
+    {
+      m_abortRead = false;
+      return nullptr;
+    }
+  }
+
+  return m_timeshiftBuffer->ReadPacket(*m_cursor);
+}
+
+void TimeshiftStream::DemuxAbort()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_abortRead = true;
+  }
+  m_condition.notify_all();
+
+  FFmpegStream::DemuxAbort();
 }
 
 bool TimeshiftStream::Start()
@@ -62,10 +213,18 @@ bool TimeshiftStream::Start()
   if (m_running)
     return true;
 
-  if (m_timeshiftBuffer.Start(GenerateStreamId(m_streamUrl)))
+  m_timeshiftBuffer = std::make_shared<TimeshiftBuffer>(m_properties);
+  if (m_timeshiftBuffer->Start(GenerateStreamId(m_streamUrl)))
   {
     Log(LOGLEVEL_DEBUG, "%s - Timeshift: started", __FUNCTION__);
-    m_running = true;
+    m_cursor = m_timeshiftBuffer->AddReader(m_demuxPacketManager);
+    m_readerOpen = true;
+    {
+      std::lock_guard<std::mutex> lock(m_readersMutex);
+      m_readers.emplace_back(this);
+      m_running = true;
+    }
+    m_timeshiftBuffer->SetIngestRunning(true);
     m_inputThread = std::thread([&] { DoReadWrite(); });
 
     return true;
@@ -77,39 +236,158 @@ bool TimeshiftStream::Start()
 
 void TimeshiftStream::Close()
 {
-  m_running = false;
-  if (m_inputThread.joinable())
-    m_inputThread.join();
+  m_readerOpen = false;
+  NotifyReader();
 
-  FFmpegStream::Close();
+  if (m_cursor)
+  {
+    // Keep what's in the buffer up to the last packet added, the export is queued while the
+    // demuxer's streams are still open
+    if (!m_properties.m_timeshiftExportFile.empty())
+      ExportTimeshift(-1, m_timeshiftBuffer->GetLastPacketTimeIndex(), m_properties.m_timeshiftExportFile);
+
+    m_timeshiftBuffer->RemoveReader(m_cursor);
+    m_cursor.reset();
+    LogStatistics();
+  }
+
+  // The ingest only stops once the last stream reading the buffer has been closed
+  if (m_ingestStream)
+  {
+    m_ingestStream->ReleaseReader(this);
+    m_timeshiftBuffer.reset();
+    m_ingestStream.reset();
+  }
+  else
+  {
+    // The ingest only writes to the buffer through the sink, but it can carry on for other
+    // readers after the kodi instance which opened it is gone, so it must not be reachable.
+    // The demuxer's lock is held for the swap so it can't happen part way through a read.
+    SetDemuxPacketManager(&m_ingestPacketAllocator);
+    ReleaseReader(this);
+  }
 
   Log(LOGLEVEL_DEBUG, "%s - Timeshift: closed", __FUNCTION__);
 }
 
+bool TimeshiftStream::ExportTimeshift(int64_t startTimeMs, int64_t endTimeMs, const std::string& exportFile)
+{
+  if (!m_timeshiftBuffer)
+    return false;
+
+  // The packets in the buffer are from the demuxer of the stream doing the ingest
+  std::map<int, AVCodecParameters*> codecParameters = GetIngestStream().CopyCodecParameters();
+
+  return TimeshiftExporter::GetInstance().QueueExport(m_timeshiftBuffer, std::move(codecParameters), startTimeMs, endTimeMs, exportFile);
+}
+
 void TimeshiftStream::DoReadWrite()
 {
   Log(LOGLEVEL_DEBUG, "%s - Timeshift: started", __FUNCTION__);
   while (m_running)
   {
-    DEMUX_PACKET* pPacket = FFmpegStream::DemuxRead();
-    if (pPacket)
-    {
-      std::lock_guard<std::mutex> lock(m_mutex);
-      m_timeshiftBuffer.AddPacket(pPacket);
-    }
-
-    m_condition.notify_one();
+    // Packets are serialized straight from the demuxer into the timeshift buffer
+    FFmpegStream::DemuxReadToSink(*this);
   }
   Log(LOGLEVEL_DEBUG, "%s - Timeshift: stopped", __FUNCTION__);
   return;
 }
 
+void TimeshiftStream::WriteDemuxPacket(const DEMUX_PACKET* packet, bool videoKeyframe)
+{
+  // The buffer only locks when the segments change, so ingest and DemuxRead don't wait on each other
+  m_timeshiftBuffer->AddPacket(packet, videoKeyframe);
+
+  // Only readers which are waiting for this packet need waking
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_waitingReaderCount > 0)
+    NotifyReaders();
+}
+
+void TimeshiftStream::NotifyReaders()
+{
+  std::lock_guard<std::mutex> lock(m_readersMutex);
+
+  for (TimeshiftStream* reader : m_readers)
+  {
+    if (reader->m_readerWaiting)
+      reader->NotifyReader();
+  }
+}
+
+void TimeshiftStream::NotifyReader()
+{
+  // Taking the lock means a reader can't be between checking for a packet and
+  // starting to wait, so the notification is never missed
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+  }
+  m_condition.notify_all();
+}
+
+void TimeshiftStream::LogStatistics()
+{
+  if (m_readWaitCount == 0)
+    return;
+
+  Log(LOGLEVEL_INFO, "%s - Timeshift reader: waited for packets %llu times, average wait: %lld us, total wait: %lld ms, wakeups without a packet: %llu",
+      __FUNCTION__, static_cast<unsigned long long>(m_readWaitCount), static_cast<long long>(m_readWaitTime.count() / m_readWaitCount),
+      static_cast<long long>(m_readWaitTime.count() / 1000), static_cast<unsigned long long>(m_emptyWakeupCount));
+}
+
 void TimeshiftStream::GetCapabilities(kodi::addon::InputstreamCapabilities& caps)
 {
   caps.SetMask(INPUTSTREAM_SUPPORTS_IDEMUX |
     INPUTSTREAM_SUPPORTS_ITIME |
     INPUTSTREAM_SUPPORTS_SEEK |
-    INPUTSTREAM_SUPPORTS_PAUSE);
+    INPUTSTREAM_SUPPORTS_PAUSE |
+    INPUTSTREAM_SUPPORTS_CHANGE_SPEED);
+}
+
+bool TimeshiftStream::GetStreamIds(std::vector<unsigned int>& ids)
+{
+  // The packets come from the demuxer of the stream doing the ingest, which can change its
+  // streams on the ingest thread, so its lock is held while they're read. Streams are only
+  // asked for when opening or after a stream change so waiting on the lock is rare.
+  TimeshiftStream& ingestStream = GetIngestStream();
+  std::lock_guard<std::recursive_mutex> lock(ingestStream.FFmpegStream::m_mutex);
+  return ingestStream.FFmpegStream::GetStreamIds(ids);
+}
+
+bool TimeshiftStream::GetStream(int streamid, kodi::addon::InputstreamInfo& info)
+{
+  TimeshiftStream& ingestStream = GetIngestStream();
+  std::lock_guard<std::recursive_mutex> lock(ingestStream.FFmpegStream::m_mutex);
+  return ingestStream.FFmpegStream::GetStream(streamid, info);
+}
+
+void TimeshiftStream::DemuxReset()
+{
+  // The demuxer belongs to the stream doing the ingest
+  if (m_ingestStream)
+    return;
+
+  FFmpegStream::DemuxReset();
+}
+
+int TimeshiftStream::GetTotalTime()
+{
+  // Only uses what's set when the ingest's demuxer is opened, so no lock is needed
+  return GetIngestStream().FFmpegStream::GetTotalTime();
+}
+
+int TimeshiftStream::GetTime()
+{
+  // The ingest holds the demuxer's lock while waiting for packets, so its time is read
+  // from what it last published instead
+  return GetIngestStream().m_ingestTime;
+}
+
+void TimeshiftStream::CurrentPTSUpdated()
+{
+  // Called on the ingest thread with the demuxer's lock held
+  FFmpegStream::CurrentPTSUpdated();
+  m_ingestTime = FFmpegStream::GetTime();
 }
 
 int64_t TimeshiftStream::LengthStream()
@@ -124,10 +402,13 @@ int64_t TimeshiftStream::LengthStream()
 
 bool TimeshiftStream::GetTimes(kodi::addon::InputstreamTimes& times)
 {
-  times.SetStartTime(m_timeshiftBuffer.GetStartTimeSecs());
+  if (!m_timeshiftBuffer)
+    return false;
+
+  times.SetStartTime(m_timeshiftBuffer->GetStartTimeSecs());
   times.SetPtsStart(0);
-  times.SetPtsBegin(m_timeshiftBuffer.GetEarliestSegmentMillisecondsSinceStart() * 1000);
-  times.SetPtsEnd(m_timeshiftBuffer.GetMillisecondsSinceStart() * 1000);
+  times.SetPtsBegin(m_timeshiftBuffer->GetEarliestSegmentMillisecondsSinceStart() * 1000);
+  times.SetPtsEnd(m_timeshiftBuffer->GetMillisecondsSinceStart() * 1000);
 
   return true;
 }
@@ -139,17 +420,32 @@ bool TimeshiftStream::IsRealTimeStream()
 
 bool TimeshiftStream::DemuxSeekTime(double timeMs, bool backwards, double& startpts)
 {
-  return m_timeshiftBuffer.Seek(timeMs);
+  if (!m_cursor)
+    return false;
+
+  const bool seeked = m_timeshiftBuffer->Seek(*m_cursor, timeMs);
+
+  // The read position moved, so a waiting reader needs to check it again
+  NotifyReader();
+
+  return seeked;
 }
 
 void TimeshiftStream::DemuxSetSpeed(int speed)
 {
   Log(LOGLEVEL_DEBUG, "%s - DemuxSetSpeed %d", __FUNCTION__, speed);
 
+  if (!m_cursor)
+    return;
+
   if (m_demuxSpeed == STREAM_PLAYSPEED_PAUSE && speed != STREAM_PLAYSPEED_PAUSE)
-    m_timeshiftBuffer.SetPaused(false); // Resume Playback
+    m_timeshiftBuffer->SetPaused(*m_cursor, false); // Resume Playback
   else if (m_demuxSpeed != STREAM_PLAYSPEED_PAUSE && speed == STREAM_PLAYSPEED_PAUSE)
-    m_timeshiftBuffer.SetPaused(true); // Pause Playback
+    m_timeshiftBuffer->SetPaused(*m_cursor, true); // Pause Playback
+
+  // Any other speed than normal or paused is trick play, the reader needs waking to switch modes
+  m_timeshiftBuffer->SetSpeed(*m_cursor, speed);
+  NotifyReader();
 
   m_demuxSpeed = speed;
 }
@@ -9,21 +9,32 @@
 
 #include "../utils/HttpProxy.h"
 #include "../utils/Properties.h"
+#include "DemuxPacketAllocator.h"
 #include "FFmpegStream.h"
+#include "IDemuxPacketSink.h"
 #include "TimeshiftBuffer.h"
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace ffmpegdirect
 {
 
+/*
+ * Streams opening the same URL share one timeshift buffer. The first stream demuxes
+ * and writes the buffer, later streams only read it, each from its own position, and
+ * see the streams of the first stream's demuxer. The first stream carries on ingesting
+ * until every stream reading its buffer has been closed.
+ */
 class TimeshiftStream
-  : public FFmpegStream
+  : public FFmpegStream, public IDemuxPacketSink, public std::enable_shared_from_this<TimeshiftStream>
 {
 public:
   TimeshiftStream(IManageDemuxPacket* demuxPacketManager,
@@ -34,32 +45,81 @@ public:
   virtual bool Open(const std::string& streamUrl, const std::string& mimeType, bool isRealTimeStream, const std::string& programProperty) override;
   virtual void Close() override;
   virtual void GetCapabilities(kodi::addon::InputstreamCapabilities& caps) override;
+  virtual bool GetStreamIds(std::vector<unsigned int>& ids) override;
+  virtual bool GetStream(int streamid, kodi::addon::InputstreamInfo& info) override;
 
+  virtual void DemuxReset() override;
   virtual DEMUX_PACKET* DemuxRead() override;
+  virtual void DemuxAbort() override;
   virtual bool DemuxSeekTime(double time, bool backwards, double& startpts) override;
   virtual void DemuxSetSpeed(int speed) override;
 
+  virtual int GetTotalTime() override;
+  virtual int GetTime() override;
   virtual bool GetTimes(kodi::addon::InputstreamTimes& times) override;
 
   virtual int64_t LengthStream() override;
   virtual bool IsRealTimeStream() override;
 
+  virtual void WriteDemuxPacket(const DEMUX_PACKET* packet, bool videoKeyframe) override;
+
+  /*
+   * Exports a range of the buffer, as packet time indexes in milliseconds, to a .ts or .mkv
+   * file in the background. A negative start time is the start of the buffer.
+   */
+  bool ExportTimeshift(int64_t startTimeMs, int64_t endTimeMs, const std::string& exportFile);
+
+protected:
+  virtual void CurrentPTSUpdated() override;
+
 private:
   void DoReadWrite();
   bool Start();
+  bool AttachToIngest(const std::string& streamUrl);
+  bool AddReader(TimeshiftStream* reader);
+  void ReleaseReader(TimeshiftStream* reader);
+  void StopIngest();
+  TimeshiftStream& GetIngestStream() { return m_ingestStream ? *m_ingestStream : *this; }
+  void NotifyReaders();
+  void NotifyReader();
+  void LogStatistics();
   std::string GenerateStreamId(const std::string streamUrl);
 
   std::mt19937 m_randomGenerator;
   std::uniform_int_distribution<> m_randomDistribution;
 
+  Properties m_properties;
+
   std::atomic<bool> m_running = {false};
   std::thread m_inputThread;
   std::condition_variable m_condition;
   std::mutex m_mutex;
+  std::atomic<bool> m_readerOpen = {false};
+  std::atomic<bool> m_readerWaiting = {false};
+  // The demuxer's time, published by the ingest thread so readers don't wait on its lock
+  std::atomic<int> m_ingestTime = {0};
+  bool m_abortRead = false;
+
+  // DemuxRead() wait statistics, only used by the reader thread
+  uint64_t m_readWaitCount = 0;
+  uint64_t m_emptyWakeupCount = 0;
+  std::chrono::microseconds m_readWaitTime{0};
 
   double m_demuxSpeed = STREAM_PLAYSPEED_NORMAL;
 
-  TimeshiftBuffer m_timeshiftBuffer{m_demuxPacketManager};
+  std::shared_ptr<TimeshiftBuffer> m_timeshiftBuffer;
+  std::shared_ptr<TimeshiftReadCursor> m_cursor;
+
+  // Set when reading the buffer of another stream, which does the ingest
+  std::shared_ptr<TimeshiftStream> m_ingestStream;
+  std::string m_registryKey;
+
+  // Only used when doing the ingest, the streams reading the buffer including this one
+  std::vector<TimeshiftStream*> m_readers;
+  // Replaces kodi's packet manager once the ingest outlives the stream which opened it
+  DemuxPacketAllocator m_ingestPacketAllocator;
+  std::mutex m_readersMutex;
+  std::atomic<int> m_waitingReaderCount = {0};
 };
 
 } //namespace ffmpegdirect
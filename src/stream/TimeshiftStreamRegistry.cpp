@@ -0,0 +1,76 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "TimeshiftStreamRegistry.h"
+
+#include "TimeshiftStream.h"
+#include "url/URL.h"
+
+#include <kodi/tools/StringUtils.h>
+
+using namespace ffmpegdirect;
+using namespace kodi::tools;
+
+TimeshiftStreamRegistry& TimeshiftStreamRegistry::GetInstance()
+{
+  static TimeshiftStreamRegistry registry;
+  return registry;
+}
+
+std::string TimeshiftStreamRegistry::GetKey(const std::string& streamUrl, const std::string& programProperty)
+{
+  std::string trimmedUrl = streamUrl;
+  StringUtils::Trim(trimmedUrl);
+
+  // The protocol is already lower case once parsed
+  CURL url(trimmedUrl);
+  std::string hostName = url.GetHostName();
+  url.SetHostName(StringUtils::ToLower(hostName));
+
+  return url.Get() + "#" + programProperty;
+}
+
+std::shared_ptr<TimeshiftStream> TimeshiftStreamRegistry::Find(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto it = m_ingestStreams.find(key);
+  if (it == m_ingestStreams.end())
+    return nullptr;
+
+  std::shared_ptr<TimeshiftStream> stream = it->second.lock();
+  if (!stream)
+    m_ingestStreams.erase(it);
+
+  return stream;
+}
+
+bool TimeshiftStreamRegistry::Register(const std::string& key, const std::shared_ptr<TimeshiftStream>& stream)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  std::weak_ptr<TimeshiftStream>& registeredStream = m_ingestStreams[key];
+  if (!registeredStream.expired())
+    return false;
+
+  registeredStream = stream;
+  return true;
+}
+
+void TimeshiftStreamRegistry::Unregister(const std::string& key, const TimeshiftStream* stream)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto it = m_ingestStreams.find(key);
+  if (it == m_ingestStreams.end())
+    return;
+
+  // Only remove the entry if it's still the stream's own, an expired entry can be removed regardless
+  std::shared_ptr<TimeshiftStream> registeredStream = it->second.lock();
+  if (!registeredStream || registeredStream.get() == stream)
+    m_ingestStreams.erase(it);
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ffmpegdirect
+{
+
+class TimeshiftStream;
+
+/*
+ * Tracks the timeshift streams which are ingesting a URL so that another stream opening
+ * the same URL, e.g. for multiview or PiP, can read from the same timeshift buffer rather
+ * than opening a second connection and writing a second set of segment files.
+ *
+ * Only weak references are held, a stream is kept alive by the streams reading from it.
+ */
+class TimeshiftStreamRegistry
+{
+public:
+  static TimeshiftStreamRegistry& GetInstance();
+
+  /*
+   * Streams can only share a buffer when the URL and program are the same. Differences in
+   * the case of the protocol and host name are ignored.
+   */
+  static std::string GetKey(const std::string& streamUrl, const std::string& programProperty);
+
+  std::shared_ptr<TimeshiftStream> Find(const std::string& key);
+
+  /*
+   * Returns false if another stream is already ingesting the key.
+   */
+  bool Register(const std::string& key, const std::shared_ptr<TimeshiftStream>& stream);
+  void Unregister(const std::string& key, const TimeshiftStream* stream);
+
+private:
+  TimeshiftStreamRegistry() = default;
+
+  std::map<std::string, std::weak_ptr<TimeshiftStream>> m_ingestStreams;
+  std::mutex m_mutex;
+};
+
+} //namespace ffmpegdirect
@@ -0,0 +1,108 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "CompressionUtils.h"
+
+#include "Log.h"
+
+#include <bzlib.h>
+#include <zlib.h>
+
+using namespace ffmpegdirect;
+
+namespace
+{
+
+// Timeshift data is compressed as it's written so speed matters more than ratio
+constexpr int ZLIB_COMPRESSION_LEVEL = Z_BEST_SPEED;
+constexpr int BZIP2_BLOCK_SIZE_100K = 9;
+
+} // unnamed namespace
+
+bool CompressionUtils::Compress(CompressionMethod method, const uint8_t* data, size_t size, std::vector<uint8_t>& compressedData)
+{
+  if (method == CompressionMethod::ZLIB)
+  {
+    uLongf compressedSize = compressBound(static_cast<uLong>(size));
+    compressedData.resize(compressedSize);
+
+    int result = compress2(compressedData.data(), &compressedSize, data, static_cast<uLong>(size), ZLIB_COMPRESSION_LEVEL);
+    if (result != Z_OK)
+    {
+      Log(LOGLEVEL_ERROR, "%s - zlib compression failed with error: %d", __FUNCTION__, result);
+      return false;
+    }
+
+    compressedData.resize(compressedSize);
+    return true;
+  }
+  else if (method == CompressionMethod::BZIP2)
+  {
+    // Worst case for bzip2 is 1% larger plus 600 bytes
+    unsigned int compressedSize = static_cast<unsigned int>(size + size / 100 + 600);
+    compressedData.resize(compressedSize);
+
+    int result = BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(compressedData.data()), &compressedSize,
+                                          const_cast<char*>(reinterpret_cast<const char*>(data)), static_cast<unsigned int>(size),
+                                          BZIP2_BLOCK_SIZE_100K, 0, 0);
+    if (result != BZ_OK)
+    {
+      Log(LOGLEVEL_ERROR, "%s - bzip2 compression failed with error: %d", __FUNCTION__, result);
+      return false;
+    }
+
+    compressedData.resize(compressedSize);
+    return true;
+  }
+
+  return false;
+}
+
+bool CompressionUtils::Decompress(CompressionMethod method, const uint8_t* data, size_t size, uint8_t* decompressedData, size_t decompressedSize)
+{
+  if (method == CompressionMethod::ZLIB)
+  {
+    uLongf outputSize = static_cast<uLongf>(decompressedSize);
+    int result = uncompress(decompressedData, &outputSize, data, static_cast<uLong>(size));
+    if (result != Z_OK || outputSize != decompressedSize)
+    {
+      Log(LOGLEVEL_ERROR, "%s - zlib decompression failed with error: %d, size: %lu, expected size: %lu", __FUNCTION__, result, static_cast<unsigned long>(outputSize), static_cast<unsigned long>(decompressedSize));
+      return false;
+    }
+
+    return true;
+  }
+  else if (method == CompressionMethod::BZIP2)
+  {
+    unsigned int outputSize = static_cast<unsigned int>(decompressedSize);
+    int result = BZ2_bzBuffToBuffDecompress(reinterpret_cast<char*>(decompressedData), &outputSize,
+                                            const_cast<char*>(reinterpret_cast<const char*>(data)), static_cast<unsigned int>(size),
+                                            0, 0);
+    if (result != BZ_OK || outputSize != decompressedSize)
+    {
+      Log(LOGLEVEL_ERROR, "%s - bzip2 decompression failed with error: %d, size: %u, expected size: %lu", __FUNCTION__, result, outputSize, static_cast<unsigned long>(decompressedSize));
+      return false;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+const char* CompressionUtils::GetMethodName(CompressionMethod method)
+{
+  switch (method)
+  {
+    case CompressionMethod::ZLIB:
+      return "zlib";
+    case CompressionMethod::BZIP2:
+      return "bzip2";
+    default:
+      return "none";
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ffmpegdirect
+{
+  enum class CompressionMethod
+    : uint8_t // stored in timeshift segment files
+  {
+    NONE = 0,
+    ZLIB,
+    BZIP2
+  };
+
+  class CompressionUtils
+  {
+  public:
+    /*
+     * \brief Compress a block of data.
+     * \param method The compression method to use.
+     * \param data The data to compress.
+     * \param size The size of the data.
+     * \param compressedData Replaced with the compressed data if successful.
+     * \return True if the data was compressed, false on error or if the method is NONE.
+     */
+    static bool Compress(CompressionMethod method, const uint8_t* data, size_t size, std::vector<uint8_t>& compressedData);
+
+    /*
+     * \brief Decompress a block of data where the decompressed size is known.
+     * \param method The compression method used.
+     * \param data The compressed data.
+     * \param size The size of the compressed data.
+     * \param decompressedData The buffer for the decompressed data.
+     * \param decompressedSize The size of the buffer, must equal the decompressed size.
+     * \return True if exactly decompressedSize bytes were decompressed.
+     */
+    static bool Decompress(CompressionMethod method, const uint8_t* data, size_t size, uint8_t* decompressedData, size_t decompressedSize);
+
+    static const char* GetMethodName(CompressionMethod method);
+  };
+} //namespace ffmpegdirect
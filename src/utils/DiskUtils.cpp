@@ -9,6 +9,11 @@
 
 #include <limits>
 
+#if defined(TARGET_LINUX) || defined(TARGET_ANDROID)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <kodi/tools/StringUtils.h>
 #include <kodi/Filesystem.h>
 
@@ -26,3 +31,69 @@ bool DiskUtils::GetFreeDiskSpaceMB(const std::string& path, uint64_t& freeMB)
 
   return success;
 }
+
+bool DiskUtils::GetLocalPath(const std::string& path, std::string& localPath)
+{
+  const std::string translatedPath = kodi::vfs::TranslateSpecialProtocol(path);
+
+  // Anything still carrying a protocol (smb://, nfs:// etc.) is not local
+  if (translatedPath.empty() || translatedPath.find("://") != std::string::npos)
+    return false;
+
+  localPath = translatedPath;
+  return true;
+}
+
+bool DiskUtils::PreallocateFile(const std::string& localPath, int64_t size)
+{
+#if defined(TARGET_LINUX) || defined(TARGET_ANDROID)
+  int fd = open(localPath.c_str(), O_WRONLY);
+  if (fd < 0)
+    return false;
+
+  // Keeping the size means readers still see the real end of the file
+  const bool success = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+  close(fd);
+
+  return success;
+#else
+  return false;
+#endif
+}
+
+bool DiskUtils::AdviseFileAccess(const std::string& localPath, FileAccessAdvice advice)
+{
+#if defined(TARGET_LINUX) || defined(TARGET_ANDROID)
+  int fd = open(localPath.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  // The page cache belongs to the file, not the descriptor, so advice through any descriptor applies
+  const int posixAdvice = advice == FileAccessAdvice::WILL_NEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+  const bool success = posix_fadvise(fd, 0, 0, posixAdvice) == 0;
+  close(fd);
+
+  return success;
+#else
+  return false;
+#endif
+}
+
+bool DiskUtils::DropBehind(const std::string& localPath, int64_t offset, int64_t length)
+{
+#if defined(TARGET_LINUX) || defined(TARGET_ANDROID)
+  int fd = open(localPath.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  // Dirty pages can't be dropped, the range before this one had its writeback started
+  // when it was written so by now it's mostly clean
+  sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+  const bool success = offset <= 0 || posix_fadvise(fd, 0, offset, POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+
+  return success;
+#else
+  return false;
+#endif
+}
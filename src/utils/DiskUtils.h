@@ -12,9 +12,49 @@
 
 namespace ffmpegdirect
 {
+  enum class FileAccessAdvice
+  {
+    WILL_NEED,
+    DONT_NEED
+  };
+
   class DiskUtils
   {
   public:
     static bool GetFreeDiskSpaceMB(const std::string& path, uint64_t& freeMB);
+
+    /*
+     * \brief Resolve a path to a location on a local filesystem, special:// paths are translated.
+     * \param path The path to resolve.
+     * \param localPath The local filesystem path if successful.
+     * \return True if the path is on a local filesystem, false for network paths or any other protocol.
+     */
+    static bool GetLocalPath(const std::string& path, std::string& localPath);
+
+    /*
+     * \brief Reserve space for a file on a local filesystem without changing its size, so it can grow without fragmenting.
+     * \param localPath The local filesystem path of an existing file.
+     * \param size The number of bytes to reserve from the start of the file.
+     * \return True if the space was reserved, false if not or not supported on this platform.
+     */
+    static bool PreallocateFile(const std::string& localPath, int64_t size);
+
+    /*
+     * \brief Tell the OS how a file on a local filesystem will be accessed so it can manage the page cache accordingly.
+     * \param localPath The local filesystem path of an existing file.
+     * \param advice How the whole file will be accessed, dirty pages are never dropped.
+     * \return True if the advice was given, false if not or not supported on this platform.
+     */
+    static bool AdviseFileAccess(const std::string& localPath, FileAccessAdvice advice);
+
+    /*
+     * \brief Start writing back a range just written to a file on a local filesystem and drop everything before it
+     *        from the page cache, so a file written front to back never holds more than a block of dirty pages.
+     * \param localPath The local filesystem path of an existing file.
+     * \param offset The offset of the range just written.
+     * \param length The length of the range just written.
+     * \return True if the pages were dropped, false if not or not supported on this platform.
+     */
+    static bool DropBehind(const std::string& localPath, int64_t offset, int64_t length);
   };
 } //namespace ffmpegdirect
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "MemoryArena.h"
+
+using namespace ffmpegdirect;
+
+uint8_t* MemoryArena::Allocate(size_t size)
+{
+  const size_t alignedSize = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+  if (m_blocks.empty() || m_blocks.back().m_size - m_blocks.back().m_used < alignedSize)
+  {
+    // Allocations larger than the block size get a block of their own
+    const size_t blockSize = alignedSize > m_blockSize ? alignedSize : m_blockSize;
+    m_blocks.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[blockSize]), blockSize, 0});
+    m_allocatedBytes.fetch_add(blockSize, std::memory_order_relaxed);
+  }
+
+  Block& block = m_blocks.back();
+  uint8_t* data = block.m_data.get() + block.m_used;
+  block.m_used += alignedSize;
+  m_usedBytes.fetch_add(alignedSize, std::memory_order_relaxed);
+
+  return data;
+}
+
+void MemoryArena::Clear()
+{
+  m_blocks.clear();
+  m_blocks.shrink_to_fit();
+  m_allocatedBytes.store(0, std::memory_order_relaxed);
+  m_usedBytes.store(0, std::memory_order_relaxed);
+}
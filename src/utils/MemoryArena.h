@@ -0,0 +1,55 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ffmpegdirect
+{
+  /*
+   * Bump allocator handing out memory from large blocks. Individual allocations
+   * are never freed, everything is released in one go by Clear() or on destruction.
+   * Not thread safe, callers must provide their own locking. Only the byte counts
+   * can be read from any thread.
+   */
+  class MemoryArena
+  {
+  public:
+    static const size_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+    explicit MemoryArena(size_t blockSize = DEFAULT_BLOCK_SIZE) : m_blockSize(blockSize) {}
+
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    uint8_t* Allocate(size_t size);
+    void Clear();
+
+    size_t GetAllocatedBytes() const { return m_allocatedBytes.load(std::memory_order_relaxed); }
+    size_t GetUsedBytes() const { return m_usedBytes.load(std::memory_order_relaxed); }
+
+  private:
+    static const size_t ALIGNMENT = 8;
+
+    struct Block
+    {
+      std::unique_ptr<uint8_t[]> m_data;
+      size_t m_size;
+      size_t m_used;
+    };
+
+    size_t m_blockSize;
+    std::vector<Block> m_blocks;
+    std::atomic<size_t> m_allocatedBytes = {0};
+    std::atomic<size_t> m_usedBytes = {0};
+  };
+} //namespace ffmpegdirect
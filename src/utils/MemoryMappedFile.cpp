@@ -0,0 +1,68 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "MemoryMappedFile.h"
+
+#if defined(TARGET_POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace ffmpegdirect;
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  Unmap();
+}
+
+bool MemoryMappedFile::Map(const std::string& localPath)
+{
+  Unmap();
+
+#if defined(TARGET_POSIX)
+  int fd = open(localPath.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  // Segments are read front to back so let the kernel read ahead
+  madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+
+  m_data = static_cast<const uint8_t*>(data);
+  m_size = static_cast<size_t>(fileStat.st_size);
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+void MemoryMappedFile::Unmap()
+{
+#if defined(TARGET_POSIX)
+  if (m_data)
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+
+  m_data = nullptr;
+  m_size = 0;
+}
@@ -0,0 +1,40 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ffmpegdirect
+{
+  /*
+   * Read only memory mapping of a file on a local filesystem. Only available on
+   * POSIX platforms, elsewhere Map() always fails so callers fall back to kodi::vfs.
+   */
+  class MemoryMappedFile
+  {
+  public:
+    MemoryMappedFile() = default;
+    ~MemoryMappedFile();
+
+    MemoryMappedFile(const MemoryMappedFile&) = delete;
+    MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+    bool Map(const std::string& localPath);
+    void Unmap();
+
+    bool IsMapped() const { return m_data != nullptr; }
+    const uint8_t* GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+  private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+  };
+} //namespace ffmpegdirect
@@ -27,6 +27,23 @@ namespace ffmpegdirect
     CURL
   };
 
+  enum class TimeshiftCompression
+    : int // same type as addon settings
+  {
+    DEFAULT = 0,
+    NONE,
+    ZLIB,
+    BZIP2
+  };
+
+  enum class TimeshiftMode
+    : int // same type as addon settings
+  {
+    DEFAULT = 0,
+    DISK,
+    MEMORY
+  };
+
   struct Properties
   {
     std::string m_programProperty;
@@ -49,5 +66,9 @@ namespace ffmpegdirect
     int m_timezoneShiftSecs = 0;
     int m_defaultProgrammeDurationSecs = 4 * 60 * 60; //Four hours
     std::string m_programmeCatchupId;      
+
+    TimeshiftCompression m_timeshiftCompression = TimeshiftCompression::DEFAULT;
+    TimeshiftMode m_timeshiftMode = TimeshiftMode::DEFAULT;
+    std::string m_timeshiftExportFile;
   };
 } //namespace ffmpegdirect
\ No newline at end of file